@@ -46,6 +46,9 @@ extern "C" {
 
 /* Exported macro ------------------------------------------------------------*/
 /* USER CODE BEGIN EM */
+// Code that runs while a flash sector is erased, copied to RAM by the startup code(.RamFunc in the linker
+// script) so it does not stall on flash fetches
+#define RAMFUNC __attribute__((section(".RamFunc")))
 
 /* USER CODE END EM */
 
@@ -21,7 +21,9 @@
 
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "bl_version.h"
 #include "flash_app_handler.h"
+#include "image_trailer.h"
 #include "ota_update.h"
 #include <stdio.h>
 
@@ -34,9 +36,19 @@
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
-#define VERSION_MAJOR 0
-#define VERSION_MINOR 3
 #define NEW_FIRMWARE  0x34
+// Boot policy: with BOOT_FAST_PATH a normal boot only watches the UART for BOOT_UART_SNIFF_TIME ms before
+// starting the application. An update is asked for with the RTC flag, B1 held down during reset or UART
+// traffic in that time. Comment it out to always listen for BOOT_LISTEN_TIME ms.
+#define BOOT_FAST_PATH
+#define BOOT_UART_SNIFF_TIME 20
+#define BOOT_LISTEN_TIME	 3000
+// Boots a cut-off download is waited for before its partial image is dropped, counted in RTC->BKP1R
+#define RESUME_MAX_BOOTS 3
+// Prints the time from reset to the jump, the printf holds up the boot until the UART has sent it
+// #define BOOT_TIME_LOG
+// Vectors of the STM32F401xE, the 16 system exceptions and the peripheral interrupts
+#define VECTOR_TABLE_WORDS (16U + SPI4_IRQn + 1U)
 
 /* USER CODE END PD */
 
@@ -48,18 +60,28 @@
 
 /* Private variables ---------------------------------------------------------*/
 UART_HandleTypeDef huart2;
+DMA_HandleTypeDef hdma_usart2_rx;
 
 /* USER CODE BEGIN PV */
 const uint8_t BL_Version[2] = {VERSION_MAJOR, VERSION_MINOR};
+// Vector table in the startup file
+extern const uint32_t g_pfnVectors[];
+// Copy of the vector table in RAM so interrupts taken during a flash erase don't stall on the vector
+// fetch, VTOR needs it aligned to its size rounded up to a power of 2
+static uint32_t ram_vectors[VECTOR_TABLE_WORDS] __attribute__((aligned(512)));
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
 void SystemClock_Config(void);
 static void MX_GPIO_Init(void);
+static void MX_DMA_Init(void);
 static void MX_USART2_UART_Init(void);
 /* USER CODE BEGIN PFP */
 static void goto_application(uint32_t app_base_addr);
 static uint8_t restore_backup(Flash_Config_t *curr_config);
+static uint8_t slot_valid(uint32_t slot_addr, uint32_t load_addr, const Flash_Config_t *config);
+static void listen_for_update(uint8_t *rcv_buff);
+static uint32_t count_resume_boot(uint8_t resume_pending);
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
@@ -108,8 +130,15 @@ int main(void)
 
 	/* Initialize all configured peripherals */
 	MX_GPIO_Init();
+	MX_DMA_Init();
 	MX_USART2_UART_Init();
 	/* USER CODE BEGIN 2 */
+	memcpy(ram_vectors, g_pfnVectors, sizeof(ram_vectors));
+	SCB->VTOR = (uint32_t)ram_vectors;
+	__DSB();
+	// ends the sector erases started in the background, see Flash_EraseSectorStart()
+	HAL_NVIC_SetPriority(FLASH_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(FLASH_IRQn);
 	printf("Starting Bootloader v%d.%d\r\n", BL_Version[0], BL_Version[1]);
 	uint8_t rcv_buff = 0;
 	Flash_Config_t curr_config = {0};
@@ -132,19 +161,45 @@ int main(void)
 	// boot mode for new firmware, this flag can be set
 	// in the RTC backup register and then do a software reset
 	uint8_t firmware_flag_set = RTC->BKP0R & 0x01;
+	// A download that was cut off left part of a new image in the inactive slot
+	uint8_t resume_pending = ota_resume_pending();
+	// a download that is never resumed or keeps failing only holds up the first few boots
+	if (count_resume_boot(resume_pending) > RESUME_MAX_BOOTS)
+	{
+		printf("Download was not resumed in %d boots\r\n", RESUME_MAX_BOOTS);
+		ota_resume_clear();
+		resume_pending = 0;
+	}
+	// B1 held down during reset asks for an update
+	uint8_t button_pressed = HAL_GPIO_ReadPin(B1_GPIO_Port, B1_Pin) == GPIO_PIN_RESET;
 	// Checks for normal boot and waits for any UART commands being sent
-	if (curr_config.first_boot == FIRST_BOOT_FALSE && !firmware_flag_set)
+	if (curr_config.first_boot == FIRST_BOOT_FALSE && !firmware_flag_set && !button_pressed)
 	{
-		printf("Listening for UART Commands\r\n");
-		HAL_UART_Receive(&huart2, &rcv_buff, 1, 3000);
+		if (resume_pending)
+		{
+			printf("Waiting for the uploader to resume the download\r\n");
+			HAL_UART_Receive(&huart2, &rcv_buff, 1, OTA_RESUME_LISTEN_TIME);
+		}
+		else
+			listen_for_update(&rcv_buff);
+		// the partial image is in the inactive slot, the active one still boots
+		if (resume_pending && rcv_buff != NEW_FIRMWARE)
+		{
+			printf("Download was not resumed\r\n");
+			ota_resume_clear();
+		}
 	}
 	// Firmware update mode
-	if (firmware_flag_set || rcv_buff == NEW_FIRMWARE || curr_config.first_boot == FIRST_BOOT_TRUE)
+	if (firmware_flag_set || button_pressed || rcv_buff == NEW_FIRMWARE || curr_config.first_boot == FIRST_BOOT_TRUE)
 	{
 		if (curr_config.first_boot == FIRST_BOOT_TRUE)
 		{
 			printf("First Boot Detected\r\n");
 		}
+		if (button_pressed)
+		{
+			printf("Update Button Held\r\n");
+		}
 		// clears the application firmware_flag
 		if (firmware_flag_set)
 		{
@@ -154,51 +209,95 @@ int main(void)
 			PWR->CR &= ~PWR_CR_DBP;
 		}
 		printf("Starting firmware download\r\n");
-		// in case invalid address memory in Flash Config, set to SLOT0
-		uint32_t new_app_addr = MAIN_APP_SLOT_ADDR;
-		printf("Writing to Main Application Slot\r\n");
+		// the update goes to the inactive slot so the running image stays to roll back to
+		uint32_t new_app_addr = Flash_OtherSlot(Flash_ActiveSlot(&curr_config));
+		printf((new_app_addr == MAIN_APP_SLOT_ADDR) ? "Writing to Main Application Slot\r\n"
+													: "Writing to Backup Application Slot\r\n");
 		// downloads and flash the firmware
-		if (ota_download_and_flash(new_app_addr) != OTA_OK)
+		OTA_Status_t ota_ret = ota_download_and_flash(new_app_addr);
+		if (ota_ret == OTA_NO_UPDATE)
+		{
+			// the uploader found its image on the device, the slot holding it boots without a reset
+			uint32_t keep_addr = ota_get_boot_slot();
+			printf("Firmware is already on the device\r\n");
+			if (keep_addr != Flash_ActiveSlot(&curr_config) || curr_config.first_boot == FIRST_BOOT_TRUE)
+			{
+				curr_config.first_boot = FIRST_BOOT_FALSE;
+				// an image without a trailer is checked against the 8-bit CRC of its slot at the next boot
+				Image_Trailer_t trailer;
+				uint8_t crc = 0;
+				if (Image_GetTrailer(keep_addr, keep_addr, &trailer) != IMAGE_OK)
+				{
+					if (Flash_CalculateCRC(keep_addr, &crc) != FLASH_APP_OK)
+					{
+						printf("Invalid Address for CRC Calculation\r\n");
+						Error_Handler();
+					}
+					if (keep_addr == MAIN_APP_SLOT_ADDR)
+						curr_config.slot0_crc = crc;
+					else
+						curr_config.slot1_crc = crc;
+				}
+				Flash_SetActiveSlot(&curr_config, keep_addr);
+				if (Flash_WriteConfig(curr_config) != FLASH_APP_OK)
+				{
+					printf("Error writing new config\r\n");
+					Error_Handler();
+				}
+			}
+		}
+		else if (ota_ret != OTA_OK)
 		{
 			printf("OTA Update: ERROR!!\r\n");
-			printf("Checking Backup\r\n");
-			restore_backup(&curr_config);
-			if (Flash_WriteConfig(curr_config) != FLASH_APP_OK)
+			// keeps the partial image so the uploader can continue from it after the reset
+			if (ota_resume_pending())
 			{
-				printf("Error setting invalid status flag\r\n");
-				Error_Handler();
+				printf("Rebooting to wait for the download to be resumed\r\n");
+				HAL_NVIC_SystemReset();
 			}
+			// the config still points at the active slot, which was not touched
 			printf("Rebooting and running previous firmware\r\n");
 			HAL_NVIC_SystemReset();
 		}
 		else
 		{
-			// if sucessful calculate CRC using STM32 CRC peripheral
-			uint8_t crc_value = 0;
-			if (Flash_CalculateCRC(new_app_addr, &crc_value) != FLASH_APP_OK)
-			{
-				printf("Invalid Address for CRC Calculation\r\n");
-				Error_Handler();
-			}
+			// the slot CRC was built up during the download, the new slot has already been read back
+			Flash_CRC32_t slot_crc;
+			ota_get_slot_crc(&slot_crc);
+			uint8_t crc = Flash_FoldCRC32(Flash_CRC32SlotValue(&slot_crc));
 			// sets new configuration
 			curr_config.first_boot = FIRST_BOOT_FALSE;
-			curr_config.slot0_crc = crc_value;
-			if (Flash_CopySector(MAIN_APP_SLOT_ADDR, BCKUP_APP_SLOT_ADDR) != FLASH_APP_OK)
+			if (ota_get_load_addr() == new_app_addr)
 			{
-				printf("Error copying new firmware to backup\r\n");
-				Error_Handler();
+				// runs from the slot it was written to, nothing has to be copied
+				if (new_app_addr == MAIN_APP_SLOT_ADDR)
+					curr_config.slot0_crc = crc;
+				else
+					curr_config.slot1_crc = crc;
+				Flash_SetActiveSlot(&curr_config, new_app_addr);
 			}
-			if (Flash_CalculateCRC(BCKUP_APP_SLOT_ADDR, &crc_value) != FLASH_APP_OK)
-			{
-				printf("Invalid Address for CRC Calculation\r\n");
-				Error_Handler();
-			}
-			if (crc_value == curr_config.slot0_crc)
-				curr_config.slot1_crc = curr_config.slot0_crc;
 			else
 			{
-				printf("Backup copy corrupted\r\n");
-				Error_Handler();
+				// linked for the main slot(images without a trailer are) but written to the backup slot
+				printf("Copying new firmware to Main Application Slot\r\n");
+				// only the part of the slot the download wrote is copied
+				if (Image_Copy(BCKUP_APP_SLOT_ADDR, MAIN_APP_SLOT_ADDR, ota_get_image_size()) != IMAGE_OK)
+				{
+					printf("Error copying new firmware to main slot\r\n");
+					Error_Handler();
+				}
+				// reads back the image part of the copy, with a trailer that is only the image it describes
+				Image_Status_t copy_status = Image_Verify(MAIN_APP_SLOT_ADDR, MAIN_APP_SLOT_ADDR, NULL);
+				if (copy_status == IMAGE_NO_TRAILER && Flash_VerifyCRC32(MAIN_APP_SLOT_ADDR, &slot_crc) == FLASH_APP_OK)
+					copy_status = IMAGE_OK;
+				if (copy_status != IMAGE_OK)
+				{
+					printf("Main slot copy corrupted\r\n");
+					Error_Handler();
+				}
+				curr_config.slot0_crc = crc;
+				curr_config.slot1_crc = crc;
+				Flash_SetActiveSlot(&curr_config, MAIN_APP_SLOT_ADDR);
 			}
 			// writes new config into the FLASH memory
 			if (Flash_WriteConfig(curr_config) != FLASH_APP_OK)
@@ -210,20 +309,22 @@ int main(void)
 			HAL_NVIC_SystemReset();
 		}
 	}
-	// CRC tamper detection
-	uint8_t crc = 0;
-	// Calculates Flash Appliction SLOT CRC for tamper detection
-	if (Flash_CalculateCRC(MAIN_APP_SLOT_ADDR, &crc) != FLASH_APP_OK)
-	{
-		printf("Invalid Address for CRC Calculation\r\n");
-		Error_Handler();
-	}
-	// compares calculated CRC to stored CRC
-	if (crc != curr_config.slot0_crc)
+	// LD2 stays lit while the image is checked and goes off with the handoff
+	HAL_GPIO_WritePin(LD2_GPIO_Port, LD2_Pin, GPIO_PIN_SET);
+	// CRC tamper detection, the active slot boots if it holds a valid image
+	uint32_t boot_addr = Flash_ActiveSlot(&curr_config);
+	if (!slot_valid(boot_addr, boot_addr, &curr_config))
 	{
 		printf("TAMPER DETECTED!!!\r\n");
-		// Check Slot1 CRC and compare to stored CRC
-		if (restore_backup(&curr_config) != BCKUP_SUCCESS)
+		// rolls back to the other slot if its image runs from where it is
+		uint32_t other_addr = Flash_OtherSlot(boot_addr);
+		if (slot_valid(other_addr, other_addr, &curr_config))
+		{
+			printf("Rolling back to the image in the other slot\r\n");
+			Flash_SetActiveSlot(&curr_config, other_addr);
+		}
+		// a backup of an image linked for the main slot is copied there
+		else if (restore_backup(&curr_config) != BCKUP_SUCCESS)
 		{
 			printf("No valid firmware found in either Slot#\r\n");
 			printf("Turning on First Boot Mode to receive firmware\r\n");
@@ -237,7 +338,11 @@ int main(void)
 		printf("Restarting System\r\n");
 		HAL_NVIC_SystemReset();
 	}
-	goto_application(MAIN_APP_SLOT_ADDR);
+#ifdef BOOT_TIME_LOG
+	// time since HAL_Init(), the listen window is most of it without BOOT_FAST_PATH
+	printf("Boot time: %lu ms\r\n", (unsigned long)HAL_GetTick());
+#endif
+	goto_application(boot_addr);
 	/* USER CODE END 2 */
 
 	/* Infinite loop */
@@ -327,6 +432,21 @@ static void MX_USART2_UART_Init(void)
 	/* USER CODE END USART2_Init 2 */
 }
 
+/**
+ * Enable DMA controller clock
+ */
+static void MX_DMA_Init(void)
+{
+
+	/* DMA controller clock enable */
+	__HAL_RCC_DMA1_CLK_ENABLE();
+
+	/* DMA interrupt init */
+	/* DMA1_Stream5_IRQn interrupt configuration */
+	HAL_NVIC_SetPriority(DMA1_Stream5_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(DMA1_Stream5_IRQn);
+}
+
 /**
  * @brief GPIO Initialization Function
  * @param None
@@ -367,52 +487,133 @@ static void MX_GPIO_Init(void)
 }
 
 /* USER CODE BEGIN 4 */
+/**
+ * @brief Hands the core over to the application with the reset state it expects: peripherals reset, SysTick
+ * stopped, every interrupt disabled and cleared, and the vector table at the slot. Apps don't need to
+ * offset the vector table themselves.
+ *
+ * The DWT cycle counter is zeroed when the handoff starts and left running, the application can read
+ * DWT->CYCCNT first thing to get the cycles the handoff took.
+ *
+ * @param app_base_addr [ @ref APP_SLOT_ADDR ] Address of the slot to start
+ */
 static void goto_application(uint32_t app_base_addr)
 {
+	uint32_t app_sp = *(volatile uint32_t *)app_base_addr;
 	void (*app_handler)(void) = (void (*)(void))(*(volatile uint32_t *)(app_base_addr + 4));
-	HAL_GPIO_WritePin(LD2_GPIO_Port, LD2_Pin, GPIO_PIN_SET);
-	HAL_Delay(500);
-	HAL_GPIO_WritePin(LD2_GPIO_Port, LD2_Pin, GPIO_PIN_RESET);
-	//__disable_irq();
-	HAL_UART_DeInit(&huart2);
-	HAL_GPIO_DeInit(GPIOA, GPIO_PIN_2 | GPIO_PIN_3);
-	HAL_GPIO_DeInit(LD2_GPIO_Port, LD2_Pin);
+	// the last byte of printf is still being shifted out
+	while (__HAL_UART_GET_FLAG(&huart2, UART_FLAG_TC) == RESET)
+		;
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	__disable_irq();
+	SysTick->CTRL = 0;
+	SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+	// resets USART2, DMA, GPIO(LD2 goes off) and CRC through RCC, nothing left to deinit one by one
 	HAL_DeInit();
-	__set_MSP(*(volatile uint32_t *)app_base_addr);
+	for (uint32_t i = 0; i < sizeof(NVIC->ICER) / sizeof(NVIC->ICER[0]); i++)
+	{
+		NVIC->ICER[i] = 0xFFFFFFFFU;
+		NVIC->ICPR[i] = 0xFFFFFFFFU;
+	}
+	SCB->VTOR = app_base_addr;
+	__DSB();
+	__ISB();
+	__set_MSP(app_sp);
+	// PRIMASK is clear out of reset, with every interrupt disabled nothing is taken before the app sets them up
+	__enable_irq();
 	app_handler();
 }
 
-static uint8_t restore_backup(Flash_Config_t *curr_config)
+/**
+ * @brief Waits for NEW_FIRMWARE on the UART the way the boot policy says. With BOOT_FAST_PATH the line is
+ * only watched for BOOT_UART_SNIFF_TIME ms, anything else received in that time(a break reads as 0x00)
+ * opens the BOOT_LISTEN_TIME window.
+ *
+ * @param rcv_buff pointer to store the received byte
+ */
+static void listen_for_update(uint8_t *rcv_buff)
+{
+#ifdef BOOT_FAST_PATH
+	if (HAL_UART_Receive(&huart2, rcv_buff, 1, BOOT_UART_SNIFF_TIME) != HAL_OK || *rcv_buff == NEW_FIRMWARE)
+		return;
+#endif
+	printf("Listening for UART Commands\r\n");
+	HAL_UART_Receive(&huart2, rcv_buff, 1, BOOT_LISTEN_TIME);
+}
+
+/**
+ * @brief Counts the boots a cut-off download has been waited for in RTC->BKP1R, the count starts over
+ * once there is nothing left to resume.
+ *
+ * @param resume_pending 1 if the journal holds a download that can be resumed
+ * @return uint32_t boots the download has been waited for, this one included
+ */
+static uint32_t count_resume_boot(uint8_t resume_pending)
+{
+	uint32_t count = resume_pending ? RTC->BKP1R + 1U : 0U;
+	if (count != RTC->BKP1R)
+	{
+		PWR->CR |= PWR_CR_DBP;
+		RTC->BKP1R = count;
+		PWR->CR &= ~PWR_CR_DBP;
+	}
+	return count;
+}
+
+/**
+ * @brief Checks the image in a slot. A slot with an image trailer is checked against the full CRC in it over
+ * the image only, one without against the 8-bit CRC of the whole slot stored in the config.
+ *
+ * @param slot_addr [ @ref APP_SLOT_ADDR ] Address of Slot0 or Slot1
+ * @param load_addr address the image has to be linked to run from, images without a trailer are linked
+ * for the main slot
+ * @param config application config holding the 8-bit CRC of the slot
+ * @return uint8_t 1 if the slot holds a valid image
+ */
+static uint8_t slot_valid(uint32_t slot_addr, uint32_t load_addr, const Flash_Config_t *config)
 {
+	Image_Trailer_t trailer;
 	uint8_t crc = 0;
-	if (Flash_CalculateCRC(BCKUP_APP_SLOT_ADDR, &crc) != FLASH_APP_OK)
+	Image_Status_t status = Image_Verify(slot_addr, load_addr, &trailer);
+	if (status == IMAGE_OK)
+	{
+		printf("Image v%lu.%lu.%lu, %lu bytes\r\n", (unsigned long)IMAGE_VERSION_MAJOR(trailer.version),
+			   (unsigned long)IMAGE_VERSION_MINOR(trailer.version), (unsigned long)IMAGE_VERSION_PATCH(trailer.version),
+			   (unsigned long)trailer.image_size);
+		return 1;
+	}
+	if (status == IMAGE_ERR || load_addr != MAIN_APP_SLOT_ADDR)
+		return 0;
+	if (Flash_CalculateCRC(slot_addr, &crc) != FLASH_APP_OK)
 	{
 		printf("Invalid Address for CRC Calculation\r\n");
 		Error_Handler();
 	}
-	if (crc == curr_config->slot1_crc)
+	return crc == ((slot_addr == MAIN_APP_SLOT_ADDR) ? config->slot0_crc : config->slot1_crc);
+}
+
+static uint8_t restore_backup(Flash_Config_t *curr_config)
+{
+	if (slot_valid(BCKUP_APP_SLOT_ADDR, MAIN_APP_SLOT_ADDR, curr_config))
 	{
 		printf("Backup Slot has valid firmware\r\n");
 		printf("Copying backup firmware to Main Application Slot\r\n");
-		if (Flash_CopySector(BCKUP_APP_SLOT_ADDR, MAIN_APP_SLOT_ADDR) != FLASH_APP_OK)
+		// an image without a trailer has no length to go by, the whole slot is copied
+		if (Image_Copy(BCKUP_APP_SLOT_ADDR, MAIN_APP_SLOT_ADDR, APP_FLASH_SECTOR_SIZE) != IMAGE_OK)
 		{
 			printf("Copy failed\r\n");
 			Error_Handler();
 		}
-		if (Flash_CalculateCRC(MAIN_APP_SLOT_ADDR, &crc) != FLASH_APP_OK)
-		{
-			printf("Invalid Address for CRC Calculation\r\n");
-			Error_Handler();
-		}
-		if (crc != curr_config->slot1_crc)
+		// the copy is checked against the backup's CRC
+		curr_config->slot0_crc = curr_config->slot1_crc;
+		if (!slot_valid(MAIN_APP_SLOT_ADDR, MAIN_APP_SLOT_ADDR, curr_config))
 		{
 			printf("Copying Corrupted\r\n");
 			Error_Handler();
 		}
-		else
-		{
-			curr_config->slot0_crc = curr_config->slot1_crc;
-		}
+		Flash_SetActiveSlot(curr_config, MAIN_APP_SLOT_ADDR);
 		return BCKUP_SUCCESS;
 	}
 	else
@@ -0,0 +1,8 @@
+#ifndef BL_VERSION_H_
+#define BL_VERSION_H_
+
+// Bootloader version, printed at start up so update logs and benchmark results can be told apart
+#define VERSION_MAJOR 0
+#define VERSION_MINOR 7
+
+#endif // BL_VERSION_H_
@@ -0,0 +1,87 @@
+#ifndef DELTA_PATCH_H_
+#define DELTA_PATCH_H_
+
+#include <stdint.h>
+
+/*
+Streaming decoder for binary patches that rebuild a new image out of a base image in flash
+Patch is a list of commands, every number is an unsigned LEB128 varint
+INSERT: [Length << 1 | 0] [Data(Length bytes)]
+COPY:   [Length << 1 | 1] [Source Delta(zigzag)]
+
+COPY takes Length bytes from the base image starting at the end of the previous COPY plus Source
+Delta(0 at the start). Code that moved keeps a constant delta so most deltas fit in one byte.
+The base image is memory mapped and the data of an INSERT is passed straight from the input, so
+the decoder needs no buffer of its own. Commands can be split anywhere between Patch_Decode() calls.
+*/
+
+// Max number of bytes handed to the output callback in one call
+#define PATCH_OUTPUT_SIZE 256U
+
+typedef enum
+{
+	PATCH_OK,
+	PATCH_ERR
+} Patch_Status_t;
+
+typedef enum
+{
+	PATCH_STATE_CMD,
+	PATCH_STATE_INSERT,
+	PATCH_STATE_COPY_DELTA
+} Patch_State_t;
+
+/**
+ * @brief Called with each block of the new image, in order
+ *
+ * @param data new image data, points into the base image or into the patch input
+ * @param size number of bytes(at most PATCH_OUTPUT_SIZE)
+ * @return Patch_Status_t returning PATCH_ERR stops the decoding
+ */
+typedef Patch_Status_t (*Patch_Output_t)(uint8_t *data, uint16_t size);
+
+typedef struct
+{
+	uint32_t base_addr;	  // address of the base image
+	uint32_t base_size;	  // COPY can't read past this
+	uint32_t copy_pos;	  // offset in the base image the previous COPY ended at
+	uint32_t total_out;	  // number of bytes of the new image
+	uint32_t max_out;	  // decoding fails if the new image would get bigger than this
+	uint32_t varint;	  // varint being decoded
+	uint8_t varint_shift; // number of varint bits received so far
+	uint32_t length;	  // length of the current command
+	Patch_State_t state;
+	Patch_Output_t output;
+} Patch_Decoder_t;
+
+/**
+ * @brief Gets a decoder ready for a new patch
+ *
+ * @param dec decoder
+ * @param base_addr address of the base image(memory mapped)
+ * @param base_size size of the base image
+ * @param max_out max size of the new image
+ * @param output callback the new image is handed to
+ */
+void Patch_DecoderInit(Patch_Decoder_t *dec, uint32_t base_addr, uint32_t base_size, uint32_t max_out,
+					   Patch_Output_t output);
+
+/**
+ * @brief Applies the next part of the patch
+ *
+ * @param dec decoder
+ * @param in patch data
+ * @param size number of bytes in in
+ * @return Patch_Status_t PATCH_ERR on a corrupted patch, an output overflow or a failed output
+ */
+Patch_Status_t Patch_Decode(Patch_Decoder_t *dec, uint8_t *in, uint16_t size);
+
+/**
+ * @brief Checks the patch ended after a whole command
+ *
+ * @param dec decoder
+ * @return Patch_Status_t
+ */
+Patch_Status_t Patch_DecoderFinish(Patch_Decoder_t *dec);
+
+#endif // DELTA_PATCH_H_
@@ -2,8 +2,10 @@
 #define __FLASH_APP_HANDLER_H_
 
 #include "main.h"
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 /*@ref APP_SLOT_ADDR*/
 #define MAIN_APP_SLOT_ADDR	0x08020000U // SECTOR 5
@@ -13,12 +15,22 @@
 #define APP_SLOT1_FLASH_SECTOR	FLASH_SECTOR_6
 #define APP_CONFIG_FLASH_SECTOR FLASH_SECTOR_2
 #define APP_CONFIG_ADDR			0x08008000U // SECTOR 2
-#define APP_CONFIG				((volatile Flash_Config_t *)APP_CONFIG_ADDR)
+// Second sector of the config log, the log moves between the two when one is full
+#define APP_CONFIG_ALT_FLASH_SECTOR FLASH_SECTOR_4
+#define APP_CONFIG_ALT_ADDR			0x08010000U // SECTOR 4
+// Part of each config sector the log uses, sector 4 is larger than sector 2
+#define APP_CONFIG_LOG_SIZE 0x00004000U
+#define APP_JOURNAL_FLASH_SECTOR FLASH_SECTOR_3
+#define APP_JOURNAL_ADDR		 0x0800C000U // SECTOR 3
+#define APP_JOURNAL_SIZE		 0x00004000U
 
 #define APP_FLASH_SECTOR_SIZE 0x00020000
 
 #define DEVICE_VOLTAGE_RANGE FLASH_VOLTAGE_RANGE_3
 
+// Define to program with one HAL_FLASH_Program() call per byte instead of the register level word path
+// #define FLASH_WRITE_BYTEWISE
+
 /* @ref FIRST_BOOT_VALUES*/
 #define FIRST_BOOT_FALSE 0x11U
 #define FIRST_BOOT_TRUE	 0xFFU
@@ -29,21 +41,42 @@
 #define SLOT_STATUS_FLAG_SLOT0 0x01U << 0
 #define SLOT_STATUS_FLAG_SLOT1 0x01U << 1
 
+/*
+Each slot keeps the generation of the update that wrote it. The slot with the newest generation is
+the active one the bootloader boots, the other one holds the previous image to roll back to and is
+where the next update is written. Configs written before generations were kept read them erased,
+both count as 0 and the main slot is active.
+*/
 typedef struct
 {
 	volatile uint8_t first_boot; /* @ref FIRST_BOOT_VALUES*/
 	volatile uint8_t slot0_crc;
 	volatile uint8_t slot1_crc;
 	volatile uint8_t unused;
+	volatile uint32_t slot0_gen;
+	volatile uint32_t slot1_gen;
 } Flash_Config_t;
 
 typedef enum
 {
 	FLASH_APP_OK,
-	FLASH_APP_ERR
+	FLASH_APP_ERR,
+	FLASH_APP_BUSY // a sector erase is still running
 } Flash_Status_t;
+
+/*
+Running CRC-32 of an image as it is written to a slot, same CRC as Flash_CalculateCRC32(). The F4 CRC
+unit can't be given a start value, so every call brings it back to the saved CRC by feeding it one
+word worked out from that CRC. Other users of the CRC unit can run in between.
+*/
+typedef struct
+{
+	uint32_t crc;	  // CRC of the whole words fed so far
+	uint32_t size;	  // number of bytes fed
+	uint32_t partial; // bytes of the word that is not complete yet, the rest reads as erased(0xFF)
+} Flash_CRC32_t;
 /**
- * @brief Gets the application config stored in Flash Memory
+ * @brief Gets the application config stored in Flash Memory, the newest record of the config log
  *
  * @param app_config pointer to Flash_Config_t struct to store the flash config
  * @return Flash_Status_t
@@ -51,15 +84,71 @@ typedef enum
 Flash_Status_t Flash_GetConfig(Flash_Config_t *app_config);
 
 /**
- * @brief Erases a sector of the Flash Memory
+ * @brief Gets the slot with the newest generation, the main slot when they are the same
+ *
+ * @param config application config
+ * @return uint32_t [ @ref APP_SLOT_ADDR ]
+ */
+uint32_t Flash_ActiveSlot(const Flash_Config_t *config);
+
+/**
+ * @brief Gets the slot that is not the given one
+ *
+ * @param slot_addr [ @ref APP_SLOT_ADDR ]
+ * @return uint32_t [ @ref APP_SLOT_ADDR ]
+ */
+uint32_t Flash_OtherSlot(uint32_t slot_addr);
+
+/**
+ * @brief Makes a slot the active one by giving it the next generation. Only changes the config in RAM.
  *
- * @param flash_sector Flash sector to erase(Sector 2, 5, or 6 only)
+ * @param config application config
+ * @param slot_addr [ @ref APP_SLOT_ADDR ]
+ */
+void Flash_SetActiveSlot(Flash_Config_t *config, uint32_t slot_addr);
+
+/**
+ * @brief Erases a sector of the Flash Memory and waits for it
+ *
+ * @param flash_sector Flash sector to erase(Sector 2, 3, 4, 5, or 6 only)
  * @param flash_voltage_range MCU voltage range
  * @return Flash_Status_t
  */
 Flash_Status_t Flash_EraseSector(uint32_t flash_sector, uint8_t flash_voltage_range);
+
 /**
- * @brief Writes new Application config to the Flash
+ * @brief Starts erasing a sector and returns straight away, the flash end of operation interrupt
+ * finishes it(Flash_IRQHandler()). Code in flash stalls until the erase is done, this function, its
+ * callers, the frame parser and the UART handling run from RAM so data keeps coming in. Waits for an
+ * erase that is still running.
+ *
+ * @param flash_sector Flash sector to erase(Sector 2, 3, 4, 5, or 6 only)
+ * @param flash_voltage_range MCU voltage range
+ * @return Flash_Status_t
+ */
+Flash_Status_t Flash_EraseSectorStart(uint32_t flash_sector, uint8_t flash_voltage_range);
+
+/**
+ * @brief Gets the state of the last erase started by Flash_EraseSectorStart()
+ *
+ * @return Flash_Status_t FLASH_APP_BUSY while it is running
+ */
+Flash_Status_t Flash_EraseStatus(void);
+
+/**
+ * @brief Sleeps until the last erase started by Flash_EraseSectorStart() is done
+ *
+ * @return Flash_Status_t result of the erase
+ */
+Flash_Status_t Flash_EraseWait(void);
+
+/**
+ * @brief Ends the running erase, called from FLASH_IRQHandler() on end of operation or an error
+ */
+void Flash_IRQHandler(void);
+/**
+ * @brief Writes new Application config to the Flash. The config is appended to the config log, a sector
+ * is only erased when the log is full and moves to the other config sector.
  *
  * @param new_config new Application config to write to Flash
  * @return Flash_Status_t
@@ -67,17 +156,28 @@ Flash_Status_t Flash_EraseSector(uint32_t flash_sector, uint8_t flash_voltage_ra
 Flash_Status_t Flash_WriteConfig(Flash_Config_t new_config);
 
 /**
- * @brief Writes firmware data to Flash
+ * @brief Writes firmware data to Flash at an offset into the slot. The slot has to be erased, 0xFF bytes
+ * are skipped since they are already there. Programs 32 bits at a time with the unaligned head and tail
+ * done byte by byte.
  *
- * @param app_base_addr [ @ref APP_SLOT_ADDR ] Base address(0x0802 0000(Slot0, Sector 5) or 0x0804 0000(Slot1, Sector
- * 7))
+ * @param app_base_addr [ @ref APP_SLOT_ADDR ] Base address of the slot
+ * @param offset offset into the slot to write data to
  * @param data pointer to data to write to Flash
  * @param data_size size of data pointer
- * @return Flash_Status_t
+ * @return Flash_Status_t FLASH_APP_ERR if the data does not fit in the slot
  */
-Flash_Status_t Flash_WriteData(uint32_t app_base_addr, uint8_t *data, uint16_t data_size);
+Flash_Status_t Flash_WriteDataAt(uint32_t app_base_addr, uint32_t offset, uint8_t *data, uint16_t data_size);
 
-Flash_Status_t Flash_CopySector(uint32_t src_addr, uint32_t dest_addr);
+/**
+ * @brief Erases the destination slot and copies the first size bytes of the source slot to it, the
+ * rest of the destination stays erased. The image length is enough since the slot after it is erased.
+ *
+ * @param src_addr [ @ref APP_SLOT_ADDR ] slot to copy from
+ * @param dest_addr [ @ref APP_SLOT_ADDR ] slot to copy to
+ * @param size bytes to copy, rounded up to a word, APP_FLASH_SECTOR_SIZE copies the whole slot
+ * @return Flash_Status_t
+ */
+Flash_Status_t Flash_CopySector(uint32_t src_addr, uint32_t dest_addr, uint32_t size);
 /**
  * @brief Calcuates CRC for Slot0(Flash Sector 5) or Slot1 (Flash Sector 6). Only
  * calculates 128KB since Sector 5 and Sector 6 are 128KB
@@ -87,6 +187,79 @@ Flash_Status_t Flash_CopySector(uint32_t src_addr, uint32_t dest_addr);
  * @return Flash_Status_t
  */
 Flash_Status_t Flash_CalculateCRC(uint32_t flash_addr, uint8_t *calculated_crc);
+/**
+ * @brief Calculates the full 32-bit CRC of Slot0 or Slot1 with the CRC peripheral(CRC-32/MPEG-2 over
+ * the 128KB read as little endian words)
+ *
+ * @param flash_addr Address of Slot0 or Slot1
+ * @param calculated_crc pointer to variable to store the calculated crc value
+ * @return Flash_Status_t
+ */
+Flash_Status_t Flash_CalculateCRC32(uint32_t flash_addr, uint32_t *calculated_crc);
+/**
+ * @brief Feeds part of Slot0 or Slot1 into the CRC peripheral, either from a reset or on top of the
+ * previous call so a CRC can be built up as the slot gets written
+ *
+ * @param flash_addr word aligned address inside Slot0 or Slot1
+ * @param size number of bytes, multiple of 4
+ * @param reset 1 to start a new CRC, 0 to continue the previous one
+ * @param calculated_crc pointer to variable to store the CRC so far
+ * @return Flash_Status_t
+ */
+Flash_Status_t Flash_CalculateCRC32Range(uint32_t flash_addr, uint32_t size, uint8_t reset, uint32_t *calculated_crc);
+/**
+ * @brief Starts a running CRC at the start of a slot
+ *
+ * @param ctx running CRC
+ */
+void Flash_CRC32Init(Flash_CRC32_t *ctx);
+/**
+ * @brief Feeds the next bytes of the image into a running CRC
+ *
+ * @param ctx running CRC
+ * @param data image data
+ * @param size number of bytes
+ */
+void Flash_CRC32Update(Flash_CRC32_t *ctx, const uint8_t *data, uint32_t size);
+/**
+ * @brief Feeds erased bytes(0xFF) into a running CRC, for parts of the slot that are left erased
+ *
+ * @param ctx running CRC
+ * @param size number of bytes
+ */
+void Flash_CRC32Fill(Flash_CRC32_t *ctx, uint32_t size);
+/**
+ * @brief Gets the CRC the whole slot has once the image fed so far is in it and the rest is erased,
+ * the same value Flash_CalculateCRC32() reads back
+ *
+ * @param ctx running CRC
+ * @return uint32_t
+ */
+uint32_t Flash_CRC32SlotValue(const Flash_CRC32_t *ctx);
+/**
+ * @brief Gets the CRC of the bytes fed so far with the open word padded with erased bytes(0xFF), the
+ * value Flash_CalculateCRC32Range() reads back over the same words
+ *
+ * @param ctx running CRC
+ * @return uint32_t
+ */
+uint32_t Flash_CRC32Value(const Flash_CRC32_t *ctx);
+/**
+ * @brief Reads back the part of a slot a running CRC covers and checks it has the same CRC. Only the
+ * image is read, not the whole slot.
+ *
+ * @param flash_addr Address of Slot0 or Slot1
+ * @param ctx running CRC of the image that should be in the slot
+ * @return Flash_Status_t FLASH_APP_ERR if the slot does not hold the image
+ */
+Flash_Status_t Flash_VerifyCRC32(uint32_t flash_addr, const Flash_CRC32_t *ctx);
+/**
+ * @brief Folds a 32-bit CRC into the 8-bit CRC the config stores
+ *
+ * @param crc 32-bit CRC
+ * @return uint8_t
+ */
+uint8_t Flash_FoldCRC32(uint32_t crc);
 /**
  * @brief Gets the HAL Flash sector macro based on the given address.
  *
@@ -0,0 +1,96 @@
+#ifndef IMAGE_TRAILER_H_
+#define IMAGE_TRAILER_H_
+
+#include "flash_app_handler.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Describes the image in a slot so only the bytes that exist are checked at boot instead of the whole
+128KB. The trailer is made by pack_image.py on the host and sent after the image in END DATA, the
+bootloader checks it against what was written and programs it into the last IMAGE_TRAILER_SIZE
+bytes of the slot. Apps are linked to start at the slot, so the trailer goes at the end where it
+does not move the vector table. Slots without a trailer(images from older uploaders) fall back to
+the 8-bit CRC in the config.
+
+Image CRC is CRC-32/MPEG-2 over the image as little endian words like Flash_CalculateCRC32(), the
+last word padded with 0xFF the way it is in flash. Trailer CRC is the same CRC over every field
+before it.
+*/
+
+#define IMAGE_TRAILER_MAGIC	  0x494D4754U
+#define IMAGE_TRAILER_VERSION 1U
+#define IMAGE_TRAILER_SIZE	  32U
+#define IMAGE_TRAILER_OFFSET  (APP_FLASH_SECTOR_SIZE - IMAGE_TRAILER_SIZE)
+// Largest image that leaves room for the trailer
+#define IMAGE_MAX_SIZE IMAGE_TRAILER_OFFSET
+
+// Packs major.minor.patch into Image_Trailer_t version
+#define IMAGE_VERSION(major, minor, patch) (((uint32_t)(major) << 24) | ((uint32_t)(minor) << 16) | (uint32_t)(patch))
+#define IMAGE_VERSION_MAJOR(version)	   ((version) >> 24)
+#define IMAGE_VERSION_MINOR(version)	   (((version) >> 16) & 0xFFU)
+#define IMAGE_VERSION_PATCH(version)	   ((version) & 0xFFFFU)
+
+typedef enum
+{
+	IMAGE_OK,
+	IMAGE_ERR,
+	IMAGE_NO_TRAILER
+} Image_Status_t;
+
+typedef struct
+{
+	uint32_t magic;		   // IMAGE_TRAILER_MAGIC
+	uint16_t format;	   // IMAGE_TRAILER_VERSION
+	uint16_t size;		   // IMAGE_TRAILER_SIZE
+	uint32_t image_size;   // bytes of the image from the start of the slot
+	uint32_t load_addr;	   // address the image is linked to run from
+	uint32_t version;	   // IMAGE_VERSION() of the image
+	uint32_t image_crc;	   // CRC of the image_size bytes
+	uint32_t reserved;	   // 0xFFFFFFFF
+	uint32_t trailer_crc;  // CRC of the fields above
+} Image_Trailer_t;
+
+_Static_assert(sizeof(Image_Trailer_t) == IMAGE_TRAILER_SIZE, "Image_Trailer_t does not match IMAGE_TRAILER_SIZE");
+
+/**
+ * @brief Checks the fields of a trailer
+ *
+ * @param trailer trailer to check
+ * @param load_addr address the image has to be linked to
+ * @return Image_Status_t IMAGE_NO_TRAILER if the magic is missing, IMAGE_ERR if a field is wrong
+ */
+Image_Status_t Image_CheckTrailer(const Image_Trailer_t *trailer, uint32_t load_addr);
+
+/**
+ * @brief Reads the trailer at the end of a slot and checks its fields
+ *
+ * @param slot_addr [ @ref APP_SLOT_ADDR ] Address of Slot0 or Slot1
+ * @param load_addr address the image has to be linked to
+ * @param trailer pointer to store the trailer
+ * @return Image_Status_t
+ */
+Image_Status_t Image_GetTrailer(uint32_t slot_addr, uint32_t load_addr, Image_Trailer_t *trailer);
+
+/**
+ * @brief Checks the image in a slot against its trailer. Only the image_size bytes are read.
+ *
+ * @param slot_addr [ @ref APP_SLOT_ADDR ] Address of Slot0 or Slot1
+ * @param load_addr address the image has to be linked to
+ * @param trailer pointer to store the trailer, can be NULL
+ * @return Image_Status_t IMAGE_NO_TRAILER if the slot has no trailer, IMAGE_ERR if it does not match
+ */
+Image_Status_t Image_Verify(uint32_t slot_addr, uint32_t load_addr, Image_Trailer_t *trailer);
+
+/**
+ * @brief Copies the image in a slot to the other slot. With a trailer only its image_size bytes and the
+ * trailer are copied, without one the first size bytes.
+ *
+ * @param src_addr [ @ref APP_SLOT_ADDR ] slot to copy from
+ * @param dest_addr [ @ref APP_SLOT_ADDR ] slot to copy to, the image has to be linked to run from it
+ * @param size bytes to copy from a slot without a trailer, APP_FLASH_SECTOR_SIZE when it is not known
+ * @return Image_Status_t IMAGE_ERR if the trailer is corrupted or the copy fails
+ */
+Image_Status_t Image_Copy(uint32_t src_addr, uint32_t dest_addr, uint32_t size);
+
+#endif // IMAGE_TRAILER_H_
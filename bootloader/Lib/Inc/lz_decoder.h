@@ -0,0 +1,91 @@
+#ifndef LZ_DECODER_H_
+#define LZ_DECODER_H_
+
+#include <stdint.h>
+
+/*
+Streaming decoder for LZ4 block format sequences with the match offset limited to LZ_WINDOW_SIZE
+[Token(1 byte)] [Literal Length(0+ bytes)] [Literals] [Offset(2 bytes)] [Match Length(0+ bytes)]
+The high nibble of the token is the literal length and the low nibble the match length - 4, a
+nibble of 15 is followed by extra length bytes that are added up until one is not 255. The stream
+ends with a sequence that only has literals.
+
+The input can be split anywhere(e.g. across data frames), the decoder keeps its state between
+LZ_Decode() calls. Output goes into the history window and is handed to the flush callback in
+LZ_FLUSH_SIZE blocks, so the whole RAM budget is the LZ_Decoder_t struct.
+*/
+
+// Must be a power of 2, the uploader never uses a match offset above it
+#define LZ_WINDOW_SIZE 4096U
+// Must divide LZ_WINDOW_SIZE
+#define LZ_FLUSH_SIZE 256U
+
+#define LZ_MIN_MATCH 4U
+
+typedef enum
+{
+	LZ_OK,
+	LZ_ERR
+} LZ_Status_t;
+
+typedef enum
+{
+	LZ_STATE_TOKEN,
+	LZ_STATE_LITERAL_LEN,
+	LZ_STATE_LITERALS,
+	LZ_STATE_OFFSET_LSB,
+	LZ_STATE_OFFSET_MSB,
+	LZ_STATE_MATCH_LEN
+} LZ_State_t;
+
+/**
+ * @brief Called with each block of decoded data, in order
+ *
+ * @param data decoded data
+ * @param size number of bytes(LZ_FLUSH_SIZE except for the last block)
+ * @return LZ_Status_t returning LZ_ERR stops the decoding
+ */
+typedef LZ_Status_t (*LZ_Flush_t)(uint8_t *data, uint16_t size);
+
+typedef struct
+{
+	uint8_t history[LZ_WINDOW_SIZE];
+	uint16_t pos;		// index the next decoded byte goes to
+	uint16_t flushed;	// index up to which the history has been flushed
+	uint32_t total_out; // number of decoded bytes
+	uint32_t max_out;	// decoding fails if the output would get bigger than this
+	uint32_t literal_len;
+	uint32_t match_len;
+	uint16_t offset;
+	LZ_State_t state;
+	LZ_Flush_t flush;
+} LZ_Decoder_t;
+
+/**
+ * @brief Gets a decoder ready for a new stream
+ *
+ * @param dec decoder
+ * @param max_out max number of decoded bytes(size of the destination)
+ * @param flush callback the decoded data is handed to
+ */
+void LZ_DecoderInit(LZ_Decoder_t *dec, uint32_t max_out, LZ_Flush_t flush);
+
+/**
+ * @brief Decodes the next part of the compressed stream
+ *
+ * @param dec decoder
+ * @param in compressed data
+ * @param size number of bytes in in
+ * @return LZ_Status_t LZ_ERR on a corrupted stream, an output overflow or a failed flush
+ */
+LZ_Status_t LZ_Decode(LZ_Decoder_t *dec, const uint8_t *in, uint16_t size);
+
+/**
+ * @brief Flushes the last decoded bytes and checks the stream ended after a whole sequence
+ *
+ * @param dec decoder
+ * @return LZ_Status_t
+ */
+LZ_Status_t LZ_DecoderFinish(LZ_Decoder_t *dec);
+
+#endif // LZ_DECODER_H_
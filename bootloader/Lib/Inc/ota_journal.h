@@ -0,0 +1,66 @@
+#ifndef OTA_JOURNAL_H_
+#define OTA_JOURNAL_H_
+
+#include "flash_app_handler.h"
+#include <stdint.h>
+
+/*
+Progress of a download is kept in flash sector 3 so it survives a reset or power loss. The sector is
+erased when a download starts and every committed data frame appends a record after the last one,
+the newest valid record is the progress. The check word is written last so a record cut short by a
+power loss is ignored.
+*/
+
+#define JOURNAL_MAGIC 0x4A524E4CU
+
+typedef enum
+{
+	JOURNAL_OK,
+	JOURNAL_ERR
+} Journal_Status_t;
+
+typedef struct
+{
+	uint32_t image_crc;	   // Flash_CalculateCRC32() value of the slot once the image is complete
+	uint16_t next_seq;	   // every data frame before it is in flash
+	uint16_t image_mode;   // OTA_Image_Mode_t of the download
+	uint32_t write_offset; // offset into the slot the next data frame is written at
+	uint32_t prefix_crc;   // CRC of the slot up to write_offset rounded down to a word
+	uint32_t check;		   // JOURNAL_MAGIC XOR the other words
+} Journal_Record_t;
+
+/**
+ * @brief Erases the journal if it was not cleared and writes the first record of a new download
+ *
+ * @param image_crc CRC of the slot with the complete image
+ * @param image_mode image mode of the download
+ * @return Journal_Status_t
+ */
+Journal_Status_t Journal_Start(uint32_t image_crc, uint16_t image_mode);
+
+/**
+ * @brief Appends a progress record for the download the journal was started with
+ *
+ * @param next_seq every data frame before it is in flash
+ * @param write_offset offset into the slot the next data frame is written at
+ * @param prefix_crc CRC of the slot up to write_offset rounded down to a word
+ * @return Journal_Status_t JOURNAL_ERR if the journal is full or was not started
+ */
+Journal_Status_t Journal_Append(uint16_t next_seq, uint32_t write_offset, uint32_t prefix_crc);
+
+/**
+ * @brief Gets the newest valid record
+ *
+ * @param record pointer to store the record
+ * @return Journal_Status_t JOURNAL_ERR if there is no valid record
+ */
+Journal_Status_t Journal_GetLast(Journal_Record_t *record);
+
+/**
+ * @brief Erases the journal if it holds anything
+ *
+ * @return Journal_Status_t
+ */
+Journal_Status_t Journal_Clear(void);
+
+#endif // OTA_JOURNAL_H_
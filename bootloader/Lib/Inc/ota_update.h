@@ -1,29 +1,185 @@
 #ifndef OTA_UPDATE_H_
 #define OTA_UPDATE_H_
 
+#include "delta_patch.h"
 #include "flash_app_handler.h"
+#include "image_trailer.h"
+#include "lz_decoder.h"
 #include "main.h"
+#include "ota_journal.h"
+#include "uart_rx_ring.h"
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
 
-#define OTA_SOF 0x1A
-#define OTA_EOF 0xF3
+#define OTA_SOF_V2 0x1C // v2 frames(XOR checksum), rejected with a status NACK
+#define OTA_SOF_V3 0x1D
+#define OTA_EOF	   0xF3
 
-#define OTA_ACK	 0xAA
-#define OTA_NACK 0xFF
+// Window status responses, see Status Response below
+#define OTA_STATUS_ACK	0xAB
+#define OTA_STATUS_NACK 0xAC
 
 #define OTA_BOOTLOADER_UPLOAD_READY 0xA2
+// Erase State of the Ready Response, see Ready Response below
+#define OTA_ERASE_STATE_NONE  0x00
+#define OTA_ERASE_STATE_AHEAD 0x01
+// Answer to SLOT INFO, see Slot Info Response below
+#define OTA_SLOT_INFO 0xA3
+// Answer to IMAGE INFO, see Image Info Response below
+#define OTA_IMAGE_INFO 0xA4
+// Answer to BLOCK HASHES, see Block Hashes Response below
+#define OTA_BLOCK_HASHES 0xA5
 
 #define MAX_DATA_SIZE 2048
 
+// Data Type, Seq and Data Size, the part of the frame the CRC covers besides Data
+#define OTA_FRAME_HEADER_SIZE 5
+
 #define MAX_RETRIES 5
 
-#define MAX_SOF_RETRIES 10
+// Max time in ms the line can be idle in the middle of a frame before the frame is dropped
+#define OTA_FRAME_TIMEOUT 200
+
+// Time in ms the bootloader waits for the uploader after a reset when a download can be resumed
+#define OTA_RESUME_LISTEN_TIME 30000
+
+// Bytes programmed to flash between two passes of the frame parser
+#define OTA_PROGRAM_SLICE_SIZE 256
+
+// Time in ms between checks of the slot erase while frames are buffered
+#define OTA_ERASE_POLL_TIME 5
+
+// Broken frames kept to be logged once the slot erase is done, the ones after them are not logged
+#define OTA_FRAME_LOG_SIZE 8
+
+// Baud rate every session starts at and falls back to
+#define OTA_DEFAULT_BAUD 115200U
+// Max difference in percent between the requested and the generated baud rate
+#define OTA_BAUD_MAX_ERROR 2U
+// Time in ms to wait for each link probe after a baud rate change
+#define OTA_BAUD_CONFIRM_TIMEOUT 1000
+// Number of link probes that have to get through before a new baud rate is kept
+#define OTA_LINK_PROBE_COUNT 4
+#define OTA_LINK_PROBE_SIZE	 256
+// Link probe payload, every byte value once per 256 bytes
+#define OTA_LINK_PROBE_BYTE(i) ((uint8_t)((i) * 167U + 13U))
+
+// Blocks of the base slot the Block Hashes Response has a CRC for
+#define OTA_SYNC_BLOCK_SIZE	 2048U
+#define OTA_SYNC_BLOCK_COUNT (APP_FLASH_SECTOR_SIZE / OTA_SYNC_BLOCK_SIZE)
+
+// Max number of data frames the uploader can have in flight. Each one needs a MAX_DATA_SIZE buffer.
+#define OTA_WINDOW_SIZE 4
+
+#if OTA_WINDOW_SIZE < 1 || OTA_WINDOW_SIZE > 9
+#error "OTA_WINDOW_SIZE must be 1-9, the selective ACK bitmap covers 8 frames"
+#endif
 
 /*
-Data Frame
-[SOF(1 byte)] [Data Type(1 byte)] [Data Size(2 bytes)] [Data(Data Size bytes)] [CRC(1 byte)] [EOF(1 byte)]
+Data Frame (v3)
+[SOF(1 byte)] [Data Type(1 byte)] [Seq(2 bytes)] [Data Size(2 bytes)] [Data(Data Size bytes)] [CRC(4 bytes)] [EOF(1 byte)]
+
+Seq is the index of the data frame in the image starting at 0. START DATA uses 0 and END DATA uses
+the number of data frames. CRC is the CRC-32/MPEG-2 the CRC peripheral calculates over every byte
+from Data Type to the end of Data, fed as little endian words with the last word padded with zeros.
+A frame with the v2 SOF(1 byte XOR checksum) is answered with a status NACK and an error message.
+
+START DATA
+[OTA_DATA_TYPE_START_DATA(1 byte)] [Image Mode(1 byte, optional)] [Image CRC(4 bytes, optional, raw only)]
+Image Mode is one of OTA_Image_Mode_t, a START DATA without it is a raw image. IMAGE INFO, BOOT SLOT
+and BLOCK HASHES are answered first, the slot is erased in the background from the first frame that is
+not one of them on(or once START DATA is ACKed, see Ready Response). Data frames that arrive meanwhile
+are buffered and their status is sent when the erase is done and they are in flash. With Image
+CRC(the Flash_CalculateCRC32() value of the slot once the image is written) a raw download is checked
+before END DATA is ACKed and its progress is kept in the journal(see ota_journal.h). A START DATA for
+the same image after a reset or a broken session picks up where the journal left off, Next Seq of the
+status ACK tells the uploader which frame to continue from. With OTA_IMAGE_MODE_LZ the data frames
+carry the image as one compressed stream(see lz_decoder.h) that is cut into frames anywhere, so a
+sequence can span two frames.
+
+START DATA (OTA_IMAGE_MODE_DELTA)
+[OTA_DATA_TYPE_START_DATA(1 byte)] [OTA_IMAGE_MODE_DELTA(1 byte)] [New CRC(4 bytes)] [Base CRC(4 bytes)]
+The data frames carry a patch(see delta_patch.h) that rebuilds the new image out of the base slot,
+the slot that is not being written. Base CRC has to match the Base CRC of the base slot(see Slot Info
+Response) and New CRC has to match the rebuilt slot before END DATA is ACKed, the Flash_CalculateCRC32()
+value over the whole slot(image padded with 0xFF).
+
+END DATA
+[OTA_DATA_TYPE_END_DATA(1 byte)] [Image Trailer(IMAGE_TRAILER_SIZE bytes, optional)]
+Sent once every data frame is ACKed. With an Image Trailer(see image_trailer.h) the image has to
+match it before the trailer is written to the end of the slot and END DATA is ACKed. The trailer's
+load address has to be the slot being written(the image runs from there) or the main slot(the image
+is copied there once the download is done).
+
+DATA AT
+[Offset(4 bytes)] [Data(Data Size - 4 bytes)]
+Data frame that is written at Offset into the slot instead of right after the previous one, so the
+uploader can leave out runs of 0xFF since the slot is already erased. Offsets have to go up with Seq.
+Only for raw and OTA_IMAGE_MODE_SYNC images.
+
+Ready Response
+[OTA_BOOTLOADER_UPLOAD_READY(1 byte)] [Erase State(1 byte)] [\r\n]
+Sent once the bootloader is in update mode. With OTA_ERASE_STATE_AHEAD the slot is erased as soon as
+the first frame other than IMAGE INFO, BLOCK HASHES or BOOT SLOT arrives, the handshake and START DATA are answered
+right away and the first window of data frames is buffered, so the uploader can stream without
+waiting for the erase. OTA_ERASE_STATE_NONE means the slot holds a download that can be resumed, it
+is only erased if START DATA asks for a different image.
+
+Image Info Response
+[OTA_IMAGE_INFO(1 byte)] [Active Slot(4 bytes)] [Main Slot Image(16 bytes)] [Backup Slot Image(16 bytes)] [\r\n]
+Slot Image: [Image Size(4 bytes)] [Image CRC(4 bytes)] [Load Address(4 bytes)] [Version(4 bytes)]
+Answer to an IMAGE INFO frame sent before the erase starts(see Ready Response), while both slots
+are intact. Active Slot is the slot the device boots, the other one is the slot an update is written
+to. A slot with a valid trailer reports the trailer's fields once the image has been read back and
+matches it. Any other slot reports Image Size 0, the Flash_CalculateCRC32() value of the whole slot,
+the main slot as Load Address and Version 0. Once the erase has started IMAGE INFO is answered with
+a status NACK instead.
+
+BOOT SLOT
+[OTA_DATA_TYPE_BOOT_SLOT(1 byte)] [Slot Address(4 bytes)]
+Ends the session without a download when the device already has the image, see
+ota_get_boot_slot(). The active slot is accepted, the other one only if it holds an image with a
+trailer that runs from it. Answered with a status ACK, or a status NACK if the slot can't be booted
+or the erase has started and the session goes on.
+
+Slot Info Response
+[OTA_SLOT_INFO(1 byte)] [Base CRC(4 bytes)] [Slot Address(4 bytes)] [\r\n]
+Answer to a SLOT INFO frame sent before START DATA. Base CRC lets the uploader check it has the image
+the base slot holds before it sends a patch against it. It is the Image CRC of the base slot's trailer,
+or the Flash_CalculateCRC32() value of the whole slot if it has no trailer. Slot Address is the slot
+the image will be written to, so the uploader can send the image linked to run from it. A base slot
+without a trailer is read for it, SLOT INFO is best sent before any frame that starts the erase.
+
+Block Hashes Response
+[OTA_BLOCK_HASHES(1 byte)] [Block Size(2 bytes)] [Block Count(2 bytes)] [Block CRC(4 bytes) x Block Count] [\r\n]
+Answer to a BLOCK HASHES frame sent before the erase starts(see Ready Response), reading the base
+slot during the erase would stall the handshake. Block CRC is the Flash_CalculateCRC32Range() value
+of each OTA_SYNC_BLOCK_SIZE block of the base slot, so the uploader can tell which blocks of its
+image are already there. Once the erase has started BLOCK HASHES is answered with a status NACK
+instead.
+
+START DATA (OTA_IMAGE_MODE_SYNC)
+[OTA_DATA_TYPE_START_DATA(1 byte)] [OTA_IMAGE_MODE_SYNC(1 byte)] [New CRC(4 bytes)] [Base CRC(4 bytes)] [Image Size(4 bytes)]
+The data frames are DATA AT frames carrying only the blocks that differ from the base slot. Every
+gap before a frame and after the last one up to Image Size is copied from the same offset of the
+base slot. Base CRC and New CRC are checked like for OTA_IMAGE_MODE_DELTA, so a block CRC that
+matches by chance fails the download instead of leaving a wrong image.
+
+Status Response
+[OTA_STATUS_ACK or OTA_STATUS_NACK(1 byte)] [Next Seq(2 bytes)] [SACK(1 byte)] [Window(1 byte)] [\r\n]
+
+Next Seq is a cumulative ACK, every frame before it has been written to flash. Bit n of SACK is set
+when frame Next Seq + 1 + n has been received and is waiting in a buffer. Window is
+OTA_WINDOW_SIZE. A status is sent for every frame received, OTA_STATUS_NACK when the frame was
+broken. Frames in the window can arrive in any order, only the missing ones have to be resent.
+
+Baud Rate Change
+Sent at the current rate with no data frames in flight: SET BAUD -> status ACK(still at the
+current rate), then both sides switch and OTA_LINK_PROBE_COUNT LINK PROBE frames have to be
+ACKed at the new rate. If a probe is broken or missing both sides go back to OTA_DEFAULT_BAUD.
+Every session starts at OTA_DEFAULT_BAUD and the bootloader goes back to it when the session ends.
 */
 
 // Possible Data Type(Payload Type) being sent from firmware_uploader
@@ -31,30 +187,122 @@ typedef enum
 {
 	OTA_DATA_TYPE_START_DATA = 0x31,
 	OTA_DATA_TYPE_END_DATA = 0x32,
-	OTA_DATA_TYPE_DATA = 0x33
+	OTA_DATA_TYPE_DATA = 0x33,
+	OTA_DATA_TYPE_SET_BAUD = 0x35,	 // Data is the new baud rate(4 bytes)
+	OTA_DATA_TYPE_LINK_PROBE = 0x36, // Data is OTA_LINK_PROBE_SIZE bytes of OTA_LINK_PROBE_BYTE()
+	OTA_DATA_TYPE_SLOT_INFO = 0x37,	 // Answered with a Slot Info Response
+	OTA_DATA_TYPE_DATA_AT = 0x38,	 // Data frame with the offset to write it to, see DATA AT
+	OTA_DATA_TYPE_IMAGE_INFO = 0x39, // Answered with an Image Info Response
+	OTA_DATA_TYPE_BOOT_SLOT = 0x3A,	 // Data is the slot to boot without a download, see BOOT SLOT
+	OTA_DATA_TYPE_BLOCK_HASHES = 0x3B // Answered with a Block Hashes Response
 } OTA_Data_Type_t;
 
+// Payload format of the data frames, picked by the uploader in START DATA
+typedef enum
+{
+	OTA_IMAGE_MODE_RAW = 0x00,
+	OTA_IMAGE_MODE_LZ = 0x01,
+	OTA_IMAGE_MODE_DELTA = 0x02,
+	OTA_IMAGE_MODE_SYNC = 0x03
+} OTA_Image_Mode_t;
+
 typedef enum
 {
 	OTA_OK,
-	OTA_ERR
+	OTA_ERR,
+	OTA_TIMEOUT,
+	OTA_NO_UPDATE // the session ended with BOOT SLOT, nothing was written
 } OTA_Status_t;
+
+// Frame parser states, one per field of the Data Frame
+typedef enum
+{
+	OTA_PARSE_SOF,
+	OTA_PARSE_DATA_TYPE,
+	OTA_PARSE_SEQ_LSB,
+	OTA_PARSE_SEQ_MSB,
+	OTA_PARSE_SIZE_LSB,
+	OTA_PARSE_SIZE_MSB,
+	OTA_PARSE_DATA,
+	OTA_PARSE_CRC,
+	OTA_PARSE_EOF
+} OTA_Parse_State_t;
+
+typedef enum
+{
+	OTA_PARSE_INCOMPLETE,
+	OTA_PARSE_FRAME_DONE,
+	OTA_PARSE_ERR
+} OTA_Parse_Result_t;
+
+typedef struct
+{
+	OTA_Parse_State_t state;
+	OTA_Parse_Result_t result; // latched once a frame is done until it is picked up
+	uint16_t data_pos;		   // number of data bytes received so far
+	uint8_t crc_pos;		   // number of CRC bytes received so far
+} OTA_Parser_t;
 // Data Frame Struct
 typedef struct
 {
 	uint8_t sof;
 	uint8_t data_type;
+	uint16_t seq;
 	uint16_t data_size;
 	uint8_t data[MAX_DATA_SIZE];
-	uint8_t crc;
+	uint32_t crc;
 	uint8_t eof;
 } OTA_DataFrame_t;
 /**
  * @brief Erases flash, downloads the firmware from uploader, and writes it to flash memory
  *
  * @param app_addr [ @ref APP_SLOT_ADDR ]Flash Address to write firmware to
- * @return OTA_Status_t
+ * @return OTA_Status_t OTA_NO_UPDATE if the uploader found its image on the device already
  */
 OTA_Status_t ota_download_and_flash(uint32_t app_addr);
 
+/**
+ * @brief Checks whether the journal holds progress of a download that was cut off
+ *
+ * @return uint8_t 1 if a download can be resumed
+ */
+uint8_t ota_resume_pending(void);
+
+/**
+ * @brief Drops the progress of a download that was cut off
+ */
+void ota_resume_clear(void);
+
+/**
+ * @brief Gets the running CRC of the image the last download wrote, it is complete once
+ * ota_download_and_flash() returned OTA_OK
+ *
+ * @param crc pointer to store the running CRC
+ */
+void ota_get_slot_crc(Flash_CRC32_t *crc);
+
+/**
+ * @brief Gets the address the image the last download wrote is linked to run from, the slot it was
+ * written to or the main slot it has to be copied to. Images without a trailer run from the main slot.
+ *
+ * @return uint32_t [ @ref APP_SLOT_ADDR ]
+ */
+uint32_t ota_get_load_addr(void);
+
+/**
+ * @brief Gets the number of bytes from the start of the slot the last download wrote the image to, the
+ * trailer at the end of the slot is not counted
+ *
+ * @return uint32_t
+ */
+uint32_t ota_get_image_size(void);
+
+/**
+ * @brief Gets the slot the uploader asked to boot with BOOT SLOT, valid once ota_download_and_flash()
+ * returned OTA_NO_UPDATE. The other slot holds an image with a trailer that runs from it.
+ *
+ * @return uint32_t [ @ref APP_SLOT_ADDR ]
+ */
+uint32_t ota_get_boot_slot(void);
+
 #endif // eof OTA_UPDATE_H_
\ No newline at end of file
@@ -0,0 +1,75 @@
+#ifndef UART_RX_RING_H_
+#define UART_RX_RING_H_
+
+#include "main.h"
+#include <stdint.h>
+#include <string.h>
+
+/*
+DMA1 Stream5 (Channel 4) writes USART2 RX bytes into a circular buffer without CPU
+involvement. The write position is read straight from the DMA NDTR register, the IDLE line
+interrupt and the half/full transfer interrupts only refresh the bookkeeping used for
+overflow detection and wake the CPU from __WFI().
+Every function and callback is RAMFUNC so the ring keeps running, and can be restarted for a baud rate
+change, while a flash sector is erased.
+*/
+
+// Must be a power of 2 and large enough to buffer the frames of a full OTA window(4 x 2059 bytes), the
+// uploader sends them while the slot is still being erased
+#define RX_RING_SIZE 16384U
+
+typedef enum
+{
+	RX_RING_OK,
+	RX_RING_ERR,	 // UART error or ring overflow, ring was restarted and data was lost
+	RX_RING_TIMEOUT
+} RxRing_Status_t;
+
+/**
+ * @brief Starts circular DMA reception into the ring buffer with IDLE line detection
+ *
+ * @param huart UART handle with a DMA RX stream linked to it (hdmarx)
+ * @return RxRing_Status_t
+ */
+RxRing_Status_t RxRing_Start(UART_HandleTypeDef *huart);
+
+/**
+ * @brief Stops DMA reception so the UART can be used in blocking mode again
+ */
+void RxRing_Stop(void);
+
+/**
+ * @brief Gets the number of received bytes waiting in the ring buffer
+ *
+ * @return uint16_t number of unread bytes
+ */
+uint16_t RxRing_Available(void);
+
+/**
+ * @brief Reads up to len bytes that are already in the ring buffer. Never blocks, interrupts are masked while
+ * it copies.
+ *
+ * @param dst buffer to copy the data to
+ * @param len max number of bytes to copy
+ * @return uint16_t number of bytes copied
+ */
+uint16_t RxRing_ReadAvailable(uint8_t *dst, uint16_t len);
+
+/**
+ * @brief Waits until at least one byte is in the ring buffer. Sleeps with __WFI() while the
+ * line is idle.
+ *
+ * @param timeout timeout in ms (HAL_MAX_DELAY waits forever)
+ * @return RxRing_Status_t RX_RING_ERR if the ring was restarted since the last read
+ */
+RxRing_Status_t RxRing_WaitData(uint32_t timeout);
+
+/**
+ * @brief Gets the number of UART errors(overrun, framing, noise) and ring overflows seen since
+ * RxRing_Start()
+ *
+ * @return uint32_t error count
+ */
+uint32_t RxRing_GetErrorCount(void);
+
+#endif // UART_RX_RING_H_
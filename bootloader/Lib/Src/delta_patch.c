@@ -0,0 +1,139 @@
+#include "delta_patch.h"
+#include <stdio.h>
+
+// an uint32_t varint has at most 5 bytes
+#define PATCH_VARINT_MAX_SHIFT 28U
+
+/**
+ * @brief Hands data to the output callback in blocks of at most PATCH_OUTPUT_SIZE bytes
+ *
+ * @param dec decoder
+ * @param data new image data
+ * @param size number of bytes
+ * @return Patch_Status_t
+ */
+static Patch_Status_t output_data(Patch_Decoder_t *dec, uint8_t *data, uint32_t size)
+{
+	if (size > dec->max_out - dec->total_out)
+	{
+		printf("Patched image is bigger than %lu bytes\r\n", (unsigned long)dec->max_out);
+		return PATCH_ERR;
+	}
+	while (size > 0)
+	{
+		uint16_t block = (size > PATCH_OUTPUT_SIZE) ? PATCH_OUTPUT_SIZE : (uint16_t)size;
+		if (dec->output(data, block) != PATCH_OK)
+			return PATCH_ERR;
+		dec->total_out += block;
+		data += block;
+		size -= block;
+	}
+	return PATCH_OK;
+}
+
+/**
+ * @brief Adds a byte to the varint being decoded
+ *
+ * @param dec decoder
+ * @param byte next varint byte
+ * @return uint8_t 1 once the varint is complete
+ */
+static uint8_t varint_add(Patch_Decoder_t *dec, uint8_t byte)
+{
+	dec->varint |= (uint32_t)(byte & 0x7F) << dec->varint_shift;
+	dec->varint_shift += 7;
+	return (byte & 0x80) == 0;
+}
+
+/**
+ * @brief Copies the current COPY command from the base image
+ *
+ * @param dec decoder
+ * @param delta zigzag encoded source delta
+ * @return Patch_Status_t
+ */
+static Patch_Status_t copy_from_base(Patch_Decoder_t *dec, uint32_t delta)
+{
+	// zigzag decoding, lowest bit is the sign
+	int32_t offset = (int32_t)(delta >> 1) ^ -(int32_t)(delta & 1U);
+	int64_t src = (int64_t)dec->copy_pos + offset;
+	if (src < 0 || (uint64_t)src + dec->length > dec->base_size)
+	{
+		printf("Patch copies from outside of the base image\r\n");
+		return PATCH_ERR;
+	}
+	dec->copy_pos = (uint32_t)src + dec->length;
+	return output_data(dec, (uint8_t *)(dec->base_addr + (uint32_t)src), dec->length);
+}
+
+void Patch_DecoderInit(Patch_Decoder_t *dec, uint32_t base_addr, uint32_t base_size, uint32_t max_out,
+					   Patch_Output_t output)
+{
+	dec->base_addr = base_addr;
+	dec->base_size = base_size;
+	dec->copy_pos = 0;
+	dec->total_out = 0;
+	dec->max_out = max_out;
+	dec->varint = 0;
+	dec->varint_shift = 0;
+	dec->length = 0;
+	dec->state = PATCH_STATE_CMD;
+	dec->output = output;
+}
+
+Patch_Status_t Patch_Decode(Patch_Decoder_t *dec, uint8_t *in, uint16_t size)
+{
+	uint16_t i = 0;
+	while (i < size)
+	{
+		// the data of an INSERT goes out straight from the input
+		if (dec->state == PATCH_STATE_INSERT)
+		{
+			uint32_t part = size - i;
+			if (part > dec->length)
+				part = dec->length;
+			if (output_data(dec, &in[i], part) != PATCH_OK)
+				return PATCH_ERR;
+			i += part;
+			dec->length -= part;
+			if (dec->length == 0)
+				dec->state = PATCH_STATE_CMD;
+			continue;
+		}
+		if (dec->varint_shift > PATCH_VARINT_MAX_SHIFT)
+		{
+			printf("Invalid patch varint\r\n");
+			return PATCH_ERR;
+		}
+		if (!varint_add(dec, in[i++]))
+			continue;
+		uint32_t value = dec->varint;
+		dec->varint = 0;
+		dec->varint_shift = 0;
+		if (dec->state == PATCH_STATE_COPY_DELTA)
+		{
+			if (copy_from_base(dec, value) != PATCH_OK)
+				return PATCH_ERR;
+			dec->state = PATCH_STATE_CMD;
+			continue;
+		}
+		dec->length = value >> 1;
+		if (dec->length == 0)
+		{
+			printf("Empty patch command\r\n");
+			return PATCH_ERR;
+		}
+		dec->state = (value & 1U) ? PATCH_STATE_COPY_DELTA : PATCH_STATE_INSERT;
+	}
+	return PATCH_OK;
+}
+
+Patch_Status_t Patch_DecoderFinish(Patch_Decoder_t *dec)
+{
+	if (dec->state != PATCH_STATE_CMD || dec->varint_shift != 0)
+	{
+		printf("Patch ended in the middle of a command\r\n");
+		return PATCH_ERR;
+	}
+	return PATCH_OK;
+}
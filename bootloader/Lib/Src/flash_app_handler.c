@@ -1,87 +1,494 @@
 #include "flash_app_handler.h"
 
+// CRC-32/MPEG-2 polynomial of the CRC unit
+#define CRC32_POLY	0x04C11DB7U
+#define CRC32_INIT	0xFFFFFFFFU
+#define ERASED_WORD 0xFFFFFFFFU
+
+// Error flags of the FLASH status register
+#define FLASH_SR_ERRORS (FLASH_SR_SOP | FLASH_SR_WRPERR | FLASH_SR_PGAERR | FLASH_SR_PGPERR | FLASH_SR_PGSERR | FLASH_SR_RDERR)
+
+#if DEVICE_VOLTAGE_RANGE != FLASH_VOLTAGE_RANGE_3
+#error "32-bit flash programming needs FLASH_VOLTAGE_RANGE_3 (2.7V - 3.6V)"
+#endif
+
+/*
+The config is a log of records in sector 2 and the first APP_CONFIG_LOG_SIZE bytes of sector 4.
+Flash_WriteConfig() programs a record into the next erased slot of the sector the log is in instead of
+erasing, the valid record with the highest sequence number in either sector is the config. Once the
+sector is full the other one is erased and the record goes to its first slot. The full sector is only
+erased when the log comes back to it, so a power loss at any point leaves the old or the new config.
+The check word is written last so a record cut short is skipped.
+*/
+#define CONFIG_MAGIC		0x43464731U
+#define CONFIG_RECORD_WORDS (sizeof(Config_Record_t) / sizeof(uint32_t))
+#define CONFIG_MAX_RECORDS	(APP_CONFIG_LOG_SIZE / sizeof(Config_Record_t))
+
+typedef struct
+{
+	uint32_t seq;		// one more than the record before it
+	uint32_t boot;		// first_boot, slot0_crc, slot1_crc and unused packed into one word
+	uint32_t slot0_gen; // generations of the slots, see Flash_Config_t
+	uint32_t slot1_gen;
+	uint32_t check; // CONFIG_MAGIC XOR the other words
+} Config_Record_t;
+
+// What config_scan() found in one config sector
+typedef struct
+{
+	uint32_t addr;		 // start of the sector
+	uint32_t sector;	 // HAL Flash sector macro
+	uint32_t free_index; // first erased record slot, CONFIG_MAX_RECORDS if the sector is full
+	uint8_t found;		 // 1 if last holds a valid record
+	Config_Record_t last;
+} Config_Sector_t;
+
+/*
+Sector erases run in the background: Flash_EraseSectorStart() sets STRT with the end of operation and
+error interrupts on and Flash_IRQHandler() finishes the erase. While the flash is busy every fetch from
+it stalls the CPU, so the functions that run during an erase are in RAM(RAMFUNC). Programming a word
+takes about 16us, less than an interrupt round trip, so it stays a busy wait from RAM.
+*/
+static volatile Flash_Status_t erase_status = FLASH_APP_OK;
+
+/**
+ * @brief Waits for the current flash operation to finish and checks it for errors
+ *
+ * @return Flash_Status_t
+ */
+static RAMFUNC Flash_Status_t wait_flash_ready(void)
+{
+	while (FLASH->SR & FLASH_SR_BSY)
+		;
+	if (FLASH->SR & FLASH_SR_ERRORS)
+	{
+		// flags are cleared by writing 1
+		FLASH->SR = FLASH_SR_ERRORS;
+		return FLASH_APP_ERR;
+	}
+	return FLASH_APP_OK;
+}
+/**
+ * @brief Sets the parallelism and turns programming on. Flash has to be unlocked and not busy.
+ *
+ * @param psize FLASH_PSIZE_BYTE or FLASH_PSIZE_WORD
+ */
+static RAMFUNC void start_programming(uint32_t psize)
+{
+	FLASH->CR &= ~FLASH_CR_PG;
+	FLASH->CR = (FLASH->CR & CR_PSIZE_MASK) | psize | FLASH_CR_PG;
+}
+/**
+ * @brief Programs bytes one at a time straight through the FLASH registers
+ *
+ * @param addr flash address
+ * @param data data to program
+ * @param size number of bytes
+ * @return Flash_Status_t
+ */
+static RAMFUNC Flash_Status_t program_bytes(uint32_t addr, const uint8_t *data, uint32_t size)
+{
+	Flash_Status_t ret = FLASH_APP_OK;
+	start_programming(FLASH_PSIZE_BYTE);
+	for (uint32_t i = 0; i < size && ret == FLASH_APP_OK; i++)
+	{
+		// erased flash already reads 0xFF
+		if (data[i] == 0xFF)
+			continue;
+		*(volatile uint8_t *)(addr + i) = data[i];
+		ret = wait_flash_ready();
+	}
+	FLASH->CR &= ~FLASH_CR_PG;
+	return ret;
+}
+/**
+ * @brief Programs 32-bit words straight through the FLASH registers. PG stays set for the whole block so
+ * each word is one store and a busy wait instead of a HAL_FLASH_Program() call.
+ *
+ * @param addr word aligned flash address
+ * @param data data to program, does not have to be aligned
+ * @param size number of bytes, multiple of 4
+ * @return Flash_Status_t
+ */
+static RAMFUNC Flash_Status_t program_words(uint32_t addr, const uint8_t *data, uint32_t size)
+{
+	Flash_Status_t ret = FLASH_APP_OK;
+	uint32_t word;
+	start_programming(FLASH_PSIZE_WORD);
+	for (uint32_t i = 0; i < size && ret == FLASH_APP_OK; i += 4)
+	{
+		memcpy(&word, &data[i], sizeof(word));
+		if (word == 0xFFFFFFFFU)
+			continue;
+		*(volatile uint32_t *)(addr + i) = word;
+		ret = wait_flash_ready();
+	}
+	FLASH->CR &= ~FLASH_CR_PG;
+	return ret;
+}
+/**
+ * @brief Sleeps until the erase running in the background is done, the FLASH interrupt wakes the CPU up
+ */
+static RAMFUNC void erase_wait(void)
+{
+	while (erase_status == FLASH_APP_BUSY)
+		__WFI();
+}
+/**
+ * @brief Resets the ART instruction and data caches, they can still hold what was in an erased sector
+ */
+static RAMFUNC void flush_caches(void)
+{
+	if (FLASH->ACR & FLASH_ACR_ICEN)
+	{
+		__HAL_FLASH_INSTRUCTION_CACHE_DISABLE();
+		__HAL_FLASH_INSTRUCTION_CACHE_RESET();
+		__HAL_FLASH_INSTRUCTION_CACHE_ENABLE();
+	}
+	if (FLASH->ACR & FLASH_ACR_DCEN)
+	{
+		__HAL_FLASH_DATA_CACHE_DISABLE();
+		__HAL_FLASH_DATA_CACHE_RESET();
+		__HAL_FLASH_DATA_CACHE_ENABLE();
+	}
+}
+/**
+ * @brief Programs a block of erased flash, byte by byte up to the first word boundary, then by word
+ * and the remaining tail byte by byte. Flash has to be unlocked.
+ *
+ * @param addr flash address
+ * @param data data to program
+ * @param size number of bytes
+ * @return Flash_Status_t
+ */
+static RAMFUNC Flash_Status_t program_block(uint32_t addr, const uint8_t *data, uint32_t size)
+{
+	uint32_t head = (4U - (addr & 3U)) & 3U;
+	if (head > size)
+		head = size;
+	uint32_t words = (size - head) & ~3U;
+	// an erase started in the background has to finish first
+	erase_wait();
+	// clears errors left over from an earlier operation
+	while (FLASH->SR & FLASH_SR_BSY)
+		;
+	FLASH->SR = FLASH_SR_ERRORS | FLASH_SR_EOP;
+	if (program_bytes(addr, data, head) != FLASH_APP_OK)
+		return FLASH_APP_ERR;
+	if (program_words(addr + head, data + head, words) != FLASH_APP_OK)
+		return FLASH_APP_ERR;
+	return program_bytes(addr + head + words, data + head + words, size - head - words);
+}
+
+/**
+ * @brief Resets the CRC unit and brings it to a CRC it had before. Feeding a word runs 32 steps of
+ * the polynomial over the CRC XORed with the word, every step can be undone since the polynomial's
+ * lowest bit is set. Undoing them from the wanted CRC gives the word to feed after the reset.
+ *
+ * @param crc CRC the unit should hold
+ */
+static void crc_seed(uint32_t crc)
+{
+	__HAL_RCC_CRC_CLK_ENABLE();
+	CRC->CR |= CRC_CR_RESET;
+	if (crc == CRC32_INIT)
+		return;
+	for (uint8_t i = 0; i < 32; i++)
+		crc = (crc & 1U) ? ((crc ^ CRC32_POLY) >> 1) | 0x80000000U : crc >> 1;
+	CRC->DR = crc ^ CRC32_INIT;
+}
+
+/**
+ * @brief Calculates the check word of a config record
+ *
+ * @param record config record
+ * @return uint32_t
+ */
+static uint32_t config_check(const Config_Record_t *record)
+{
+	return CONFIG_MAGIC ^ record->seq ^ record->boot ^ record->slot0_gen ^ record->slot1_gen;
+}
+/**
+ * @brief Checks whether every word of a config record slot is still erased
+ *
+ * @param addr start of the config sector
+ * @param index record slot
+ * @return uint8_t 1 if the slot is free
+ */
+static uint8_t config_slot_free(uint32_t addr, uint32_t index)
+{
+	volatile uint32_t *words = (volatile uint32_t *)(addr + index * sizeof(Config_Record_t));
+	for (uint32_t i = 0; i < CONFIG_RECORD_WORDS; i++)
+	{
+		if (words[i] != 0xFFFFFFFFU)
+			return 0;
+	}
+	return 1;
+}
+/**
+ * @brief Finds the first free record slot of a config sector and the newest valid record before it.
+ * Records are written one after another, so the free slot is found with a binary search.
+ *
+ * @param addr start of the config sector
+ * @param flash_sector HAL Flash sector macro of the config sector
+ * @param sector pointer to store what was found
+ */
+static void config_scan(uint32_t addr, uint32_t flash_sector, Config_Sector_t *sector)
+{
+	uint32_t low = 0, high = CONFIG_MAX_RECORDS;
+	sector->addr = addr;
+	sector->sector = flash_sector;
+	sector->found = 0;
+	while (low < high)
+	{
+		uint32_t mid = (low + high) / 2U;
+		if (config_slot_free(addr, mid))
+			high = mid;
+		else
+			low = mid + 1U;
+	}
+	sector->free_index = low;
+	// the newest record is the last one written unless a power loss cut it short
+	for (uint32_t i = low; i > 0 && !sector->found; i--)
+	{
+		memcpy(&sector->last, (const void *)(addr + (i - 1U) * sizeof(Config_Record_t)), sizeof(Config_Record_t));
+		sector->found = (sector->last.check == config_check(&sector->last));
+	}
+}
+/**
+ * @brief Scans both config sectors and picks the one the log is in, the one with the newest record
+ * or sector 2 if neither has one
+ *
+ * @param sectors array of 2 to store what was found in sector 2 and sector 4
+ * @return Config_Sector_t* sector the log is in
+ */
+static Config_Sector_t *config_find(Config_Sector_t *sectors)
+{
+	config_scan(APP_CONFIG_ADDR, APP_CONFIG_FLASH_SECTOR, &sectors[0]);
+	config_scan(APP_CONFIG_ALT_ADDR, APP_CONFIG_ALT_FLASH_SECTOR, &sectors[1]);
+	if (sectors[1].found && (!sectors[0].found || sectors[1].last.seq > sectors[0].last.seq))
+		return &sectors[1];
+	return &sectors[0];
+}
+/**
+ * @brief Programs a record into a free slot, the check word goes last. The slot is read back so a
+ * slot that did not take the record(one whose erase was cut short) sends the log to the other sector.
+ *
+ * @param addr start of the config sector
+ * @param index free record slot
+ * @param record record to write
+ * @return Flash_Status_t
+ */
+static Flash_Status_t config_write_record(uint32_t addr, uint32_t index, Config_Record_t *record)
+{
+	uint32_t words[CONFIG_RECORD_WORDS];
+	uint32_t record_addr = addr + index * sizeof(Config_Record_t);
+	record->check = config_check(record);
+	memcpy(words, record, sizeof(words));
+	if (HAL_FLASH_Unlock() != HAL_OK)
+		return FLASH_APP_ERR;
+	for (uint32_t i = 0; i < CONFIG_RECORD_WORDS; i++)
+	{
+		if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, record_addr + i * sizeof(uint32_t), words[i]) != HAL_OK)
+		{
+			HAL_FLASH_Lock();
+			return FLASH_APP_ERR;
+		}
+	}
+	HAL_FLASH_Lock();
+	return (memcmp((const void *)record_addr, words, sizeof(words)) == 0) ? FLASH_APP_OK : FLASH_APP_ERR;
+}
+
 Flash_Status_t Flash_GetConfig(Flash_Config_t *app_config)
 {
+	Config_Sector_t sectors[2];
+	uint32_t boot, slot0_gen, slot1_gen;
 	if (app_config == NULL)
 	{
 		return FLASH_APP_ERR;
 	}
-	app_config->first_boot = APP_CONFIG->first_boot;
-	app_config->slot0_crc = APP_CONFIG->slot0_crc;
-	app_config->slot1_crc = APP_CONFIG->slot1_crc;
+	Config_Sector_t *current = config_find(sectors);
+	if (current->found)
+	{
+		boot = current->last.boot;
+		slot0_gen = current->last.slot0_gen;
+		slot1_gen = current->last.slot1_gen;
+	}
+	else
+	{
+		// config from before the log, one word at the start of sector 2 with the generations after it
+		boot = *(volatile uint32_t *)APP_CONFIG_ADDR;
+		slot0_gen = *(volatile uint32_t *)(APP_CONFIG_ADDR + 4U);
+		slot1_gen = *(volatile uint32_t *)(APP_CONFIG_ADDR + 8U);
+		// it was only ever written once the application had been flashed, anything else there is the first
+		// record of the log(seq 0) cut short and the config is the erased one
+		if ((boot & 0xFFU) != FIRST_BOOT_FALSE)
+		{
+			boot = 0xFFFFFFFFU;
+			slot0_gen = 0xFFFFFFFFU;
+			slot1_gen = 0xFFFFFFFFU;
+		}
+	}
+	app_config->first_boot = boot & 0xFFU;
+	app_config->slot0_crc = (boot >> 8) & 0xFFU;
+	app_config->slot1_crc = (boot >> 16) & 0xFFU;
+	app_config->unused = boot >> 24;
+	// erased generations are from a config that did not keep them
+	app_config->slot0_gen = (slot0_gen == 0xFFFFFFFFU) ? 0 : slot0_gen;
+	app_config->slot1_gen = (slot1_gen == 0xFFFFFFFFU) ? 0 : slot1_gen;
 	return FLASH_APP_OK;
 }
 
+uint32_t Flash_ActiveSlot(const Flash_Config_t *config)
+{
+	return (config->slot1_gen > config->slot0_gen) ? BCKUP_APP_SLOT_ADDR : MAIN_APP_SLOT_ADDR;
+}
+
+uint32_t Flash_OtherSlot(uint32_t slot_addr)
+{
+	return (slot_addr == BCKUP_APP_SLOT_ADDR) ? MAIN_APP_SLOT_ADDR : BCKUP_APP_SLOT_ADDR;
+}
+
+void Flash_SetActiveSlot(Flash_Config_t *config, uint32_t slot_addr)
+{
+	uint32_t gen = ((config->slot0_gen > config->slot1_gen) ? config->slot0_gen : config->slot1_gen) + 1U;
+	if (slot_addr == BCKUP_APP_SLOT_ADDR)
+		config->slot1_gen = gen;
+	else
+		config->slot0_gen = gen;
+}
+
 Flash_Status_t Flash_WriteConfig(Flash_Config_t new_config)
 {
-	if (Flash_EraseSector(APP_CONFIG_FLASH_SECTOR, FLASH_VOLTAGE_RANGE_3) != FLASH_APP_OK)
+	Config_Sector_t sectors[2];
+	Config_Record_t record;
+	Config_Sector_t *current = config_find(sectors);
+	Config_Sector_t *other = (current == &sectors[0]) ? &sectors[1] : &sectors[0];
+	record.seq = current->found ? current->last.seq + 1U : 0;
+	// Stores the config in 32bit variable like the config before the log kept it
+	record.boot =
+		new_config.unused << 24 | new_config.slot1_crc << 16 | new_config.slot0_crc << 8 | new_config.first_boot;
+	record.slot0_gen = new_config.slot0_gen;
+	record.slot1_gen = new_config.slot1_gen;
+	if (current->free_index < CONFIG_MAX_RECORDS &&
+		config_write_record(current->addr, current->free_index, &record) == FLASH_APP_OK)
+		return FLASH_APP_OK;
+	// the sector is full, the log moves to the other one and the full sector stays as it is until the
+	// log comes back to it
+	if (Flash_EraseSector(other->sector, FLASH_VOLTAGE_RANGE_3) != FLASH_APP_OK)
 	{
 		printf("Error erasing app config flash\r\n");
 		return FLASH_APP_ERR;
 	}
-	if (HAL_FLASH_Unlock() != HAL_OK)
-		return FLASH_APP_ERR;
-	// Stores the config in 32bit variable to write to Flash to keep things aligned
-	uint32_t data =
-		new_config.unused << 24 | new_config.slot1_crc << 16 | new_config.slot0_crc << 8 | new_config.first_boot;
-	// writes data to flash memory
-	if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, APP_CONFIG_ADDR, data))
+	if (config_write_record(other->addr, 0, &record) != FLASH_APP_OK)
 	{
-		HAL_FLASH_Lock();
 		printf("Error Writing New Config\r\n");
 		return FLASH_APP_ERR;
 	}
-	HAL_FLASH_Lock();
 	return FLASH_APP_OK;
 }
 
 Flash_Status_t Flash_EraseSector(uint32_t flash_sector, uint8_t flash_voltage_range)
 {
-	if (flash_sector != APP_SLOT0_FLASH_SECTOR && flash_sector != APP_SLOT1_FLASH_SECTOR &&
-		flash_sector != APP_CONFIG_FLASH_SECTOR)
+	if (Flash_EraseSectorStart(flash_sector, flash_voltage_range) != FLASH_APP_OK)
 		return FLASH_APP_ERR;
-	HAL_StatusTypeDef ret = HAL_FLASH_Unlock();
-	if (ret != HAL_OK)
+	Flash_Status_t ret = Flash_EraseWait();
+	HAL_FLASH_Lock();
+	if (ret != FLASH_APP_OK)
 	{
-		printf("Can't Unlock Flash\r\n");
+		printf("Failed to Erase Flash\r\n");
+		return FLASH_APP_ERR;
+	}
+	return FLASH_APP_OK;
+}
+
+RAMFUNC Flash_Status_t Flash_EraseSectorStart(uint32_t flash_sector, uint8_t flash_voltage_range)
+{
+	uint32_t psize;
+	if (flash_sector != APP_SLOT0_FLASH_SECTOR && flash_sector != APP_SLOT1_FLASH_SECTOR &&
+		flash_sector != APP_CONFIG_FLASH_SECTOR && flash_sector != APP_CONFIG_ALT_FLASH_SECTOR &&
+		flash_sector != APP_JOURNAL_FLASH_SECTOR)
 		return FLASH_APP_ERR;
+	// erase parallelism the supply voltage allows
+	switch (flash_voltage_range)
+	{
+	case FLASH_VOLTAGE_RANGE_1:
+		psize = FLASH_PSIZE_BYTE;
+		break;
+	case FLASH_VOLTAGE_RANGE_2:
+		psize = FLASH_PSIZE_HALF_WORD;
+		break;
+	case FLASH_VOLTAGE_RANGE_3:
+		psize = FLASH_PSIZE_WORD;
+		break;
+	default:
+		psize = FLASH_PSIZE_DOUBLE_WORD;
+		break;
 	}
-	// initializes EraseInitTypeDef struct for erasing Flash Memory
-	FLASH_EraseInitTypeDef flash_erase_struct;
-	uint32_t sector_err;
-	flash_erase_struct.TypeErase = FLASH_TYPEERASE_SECTORS;
-	flash_erase_struct.Sector = flash_sector;
-	flash_erase_struct.NbSectors = 1;
-	flash_erase_struct.VoltageRange = flash_voltage_range;
-	ret = HAL_FLASHEx_Erase(&flash_erase_struct, &sector_err);
-	if (ret != HAL_OK || sector_err != 0xFFFFFFFFU)
+	erase_wait();
+	if (HAL_FLASH_Unlock() != HAL_OK)
 	{
-		printf("Failed to Erase Flash\r\n");
-		HAL_FLASH_Lock();
+		printf("Can't Unlock Flash\r\n");
 		return FLASH_APP_ERR;
 	}
+	while (FLASH->SR & FLASH_SR_BSY)
+		;
+	FLASH->SR = FLASH_SR_ERRORS | FLASH_SR_EOP;
+	erase_status = FLASH_APP_BUSY;
+	FLASH->CR = (FLASH->CR & CR_PSIZE_MASK & ~(FLASH_CR_PG | FLASH_CR_SNB)) | psize | FLASH_CR_SER |
+				(flash_sector << FLASH_CR_SNB_Pos) | FLASH_CR_EOPIE | FLASH_CR_ERRIE;
+	FLASH->CR |= FLASH_CR_STRT;
 	return FLASH_APP_OK;
 }
 
-Flash_Status_t Flash_WriteData(uint32_t app_base_addr, uint8_t *data, uint16_t data_size)
+RAMFUNC Flash_Status_t Flash_EraseStatus(void) { return erase_status; }
+
+RAMFUNC Flash_Status_t Flash_EraseWait(void)
 {
-	// keeps track of position of the flash memory as data is being written
-	static uint16_t bytes_written = 0;
-	if (data == NULL)
-		return FLASH_APP_OK;
+	erase_wait();
+	return erase_status;
+}
+
+RAMFUNC void Flash_IRQHandler(void)
+{
+	uint32_t sr = FLASH->SR;
+	// flags are cleared by writing 1
+	FLASH->SR = sr & (FLASH_SR_EOP | FLASH_SR_ERRORS);
+	if (erase_status != FLASH_APP_BUSY)
+		return;
+	FLASH->CR &= ~(FLASH_CR_SER | FLASH_CR_SNB | FLASH_CR_EOPIE | FLASH_CR_ERRIE);
+	flush_caches();
+	// the flash is left unlocked, whatever programs it next locks it when done
+	erase_status = (sr & FLASH_SR_ERRORS) ? FLASH_APP_ERR : FLASH_APP_OK;
+}
+
+Flash_Status_t Flash_WriteDataAt(uint32_t app_base_addr, uint32_t offset, uint8_t *data, uint16_t data_size)
+{
+	if (data == NULL || offset > APP_FLASH_SECTOR_SIZE || data_size > APP_FLASH_SECTOR_SIZE - offset)
+		return FLASH_APP_ERR;
 	HAL_StatusTypeDef ret = HAL_FLASH_Unlock();
 	if (ret != HAL_OK)
 		return FLASH_APP_ERR;
+#ifdef FLASH_WRITE_BYTEWISE
 	// loops through data and writes to the Flash byte by byte
 	for (uint16_t i = 0; i < data_size; i++)
 	{
-		if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, app_base_addr + bytes_written, data[i]) != HAL_OK)
+		// erased flash already reads 0xFF
+		if (data[i] == 0xFF)
+			continue;
+		if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, app_base_addr + offset + i, data[i]) != HAL_OK)
 		{
 			HAL_FLASH_Lock();
 			return FLASH_APP_ERR;
 		}
-		bytes_written++;
 	}
+#else
+	if (program_block(app_base_addr + offset, data, data_size) != FLASH_APP_OK)
+	{
+		HAL_FLASH_Lock();
+		return FLASH_APP_ERR;
+	}
+#endif
 
 	ret = HAL_FLASH_Lock();
 	if (ret != HAL_OK)
@@ -89,11 +496,13 @@ Flash_Status_t Flash_WriteData(uint32_t app_base_addr, uint8_t *data, uint16_t d
 	return FLASH_APP_OK;
 }
 
-Flash_Status_t Flash_CopySector(uint32_t src_addr, uint32_t dest_addr)
+Flash_Status_t Flash_CopySector(uint32_t src_addr, uint32_t dest_addr, uint32_t size)
 {
 	if ((src_addr != MAIN_APP_SLOT_ADDR && src_addr != BCKUP_APP_SLOT_ADDR) ||
-		(dest_addr != MAIN_APP_SLOT_ADDR && dest_addr != BCKUP_APP_SLOT_ADDR))
+		(dest_addr != MAIN_APP_SLOT_ADDR && dest_addr != BCKUP_APP_SLOT_ADDR) || size > APP_FLASH_SECTOR_SIZE)
 		return FLASH_APP_ERR;
+	// the last word of the image is padded with erased bytes in flash
+	size = (size + 3U) & ~3U;
 	if (Flash_EraseSector(Flash_GetSector(dest_addr), FLASH_VOLTAGE_RANGE_3) != FLASH_APP_OK)
 	{
 		printf("Error erasing app config flash\r\n");
@@ -101,44 +510,152 @@ Flash_Status_t Flash_CopySector(uint32_t src_addr, uint32_t dest_addr)
 	}
 	if (HAL_FLASH_Unlock() != HAL_OK)
 		return FLASH_APP_ERR;
-	volatile uint32_t *src_addr_curr = (volatile uint32_t *)src_addr;
-	volatile uint32_t *src_addr_end = (volatile uint32_t *)(src_addr + APP_FLASH_SECTOR_SIZE);
-	volatile uint32_t *dest_addr_curr = (volatile uint32_t *)dest_addr;
-	while (src_addr_curr < src_addr_end)
+	// erased words inside the image are skipped as well
+	if (program_block(dest_addr, (const uint8_t *)src_addr, size) != FLASH_APP_OK)
 	{
-		if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, (uint32_t)dest_addr_curr++, *src_addr_curr++) != HAL_OK)
-		{
-			HAL_FLASH_Lock();
-			return FLASH_APP_ERR;
-		}
+		HAL_FLASH_Lock();
+		return FLASH_APP_ERR;
 	}
 	HAL_FLASH_Lock();
 	return FLASH_APP_OK;
 }
 
-Flash_Status_t Flash_CalculateCRC(uint32_t flash_addr, uint8_t *calculated_crc)
+Flash_Status_t Flash_CalculateCRC32(uint32_t flash_addr, uint32_t *calculated_crc)
+{
+	if (!Flash_ValidFlashAppMem(flash_addr))
+		return FLASH_APP_ERR;
+	return Flash_CalculateCRC32Range(flash_addr, APP_FLASH_SECTOR_SIZE, 1, calculated_crc);
+}
+
+Flash_Status_t Flash_CalculateCRC32Range(uint32_t flash_addr, uint32_t size, uint8_t reset, uint32_t *calculated_crc)
 {
-	if (!Flash_ValidFlashAppMem(flash_addr) || calculated_crc == NULL)
+	uint32_t slot_addr = (flash_addr >= BCKUP_APP_SLOT_ADDR) ? BCKUP_APP_SLOT_ADDR : MAIN_APP_SLOT_ADDR;
+	if (flash_addr < MAIN_APP_SLOT_ADDR || (flash_addr & 3U) || (size & 3U) || calculated_crc == NULL ||
+		flash_addr - slot_addr + size > APP_FLASH_SECTOR_SIZE)
 		return FLASH_APP_ERR;
 	// enables RCC of CRC peripheral
 	__HAL_RCC_CRC_CLK_ENABLE();
 	// Resets the CRC
-	CRC->CR |= CRC_CR_RESET;
-	// Gets the flash address and calculates the end of the flash sector
+	if (reset)
+		CRC->CR |= CRC_CR_RESET;
+	// Gets the flash address and calculates the end of the range
 	volatile uint32_t *addr = (volatile uint32_t *)flash_addr;
-	volatile uint32_t *final_addr = (volatile uint32_t *)(flash_addr + APP_FLASH_SECTOR_SIZE);
+	volatile uint32_t *final_addr = (volatile uint32_t *)(flash_addr + size);
 	// loops through and sends flash data by WORD(32-bit) to CRC DR
 	while (addr < final_addr)
 	{
 		CRC->DR = *addr++;
 	}
 	// Reads the calculated CRC value
-	uint32_t crc = CRC->DR;
-	// calculated CRC is stored as 8 bit value so we XOR the 4 bytes of CRC with each other
-	*calculated_crc = ((crc >> 24) & 0xFF) ^ ((crc >> 16) & 0xFF) ^ ((crc >> 8) & 0xFF) ^ (crc & 0xFF);
+	*calculated_crc = CRC->DR;
 	return FLASH_APP_OK;
 }
 
+Flash_Status_t Flash_CalculateCRC(uint32_t flash_addr, uint8_t *calculated_crc)
+{
+	uint32_t crc = 0;
+	if (calculated_crc == NULL || Flash_CalculateCRC32(flash_addr, &crc) != FLASH_APP_OK)
+		return FLASH_APP_ERR;
+	*calculated_crc = Flash_FoldCRC32(crc);
+	return FLASH_APP_OK;
+}
+
+void Flash_CRC32Init(Flash_CRC32_t *ctx)
+{
+	ctx->crc = CRC32_INIT;
+	ctx->size = 0;
+	ctx->partial = ERASED_WORD;
+}
+
+void Flash_CRC32Update(Flash_CRC32_t *ctx, const uint8_t *data, uint32_t size)
+{
+	uint32_t word;
+	if (size == 0)
+		return;
+	crc_seed(ctx->crc);
+	// finishes the word an earlier call left open
+	for (; size > 0 && (ctx->size & 3U); size--, ctx->size++)
+	{
+		uint8_t shift = (ctx->size & 3U) * 8U;
+		ctx->partial = (ctx->partial & ~(0xFFU << shift)) | ((uint32_t)*data++ << shift);
+		if ((ctx->size & 3U) == 3U)
+		{
+			CRC->DR = ctx->partial;
+			ctx->partial = ERASED_WORD;
+		}
+	}
+	// little endian words like Flash_CalculateCRC32() reads them, data does not have to be aligned
+	for (; size >= sizeof(word); size -= sizeof(word), ctx->size += sizeof(word), data += sizeof(word))
+	{
+		memcpy(&word, data, sizeof(word));
+		CRC->DR = word;
+	}
+	for (uint8_t shift = 0; size > 0; size--, ctx->size++, shift += 8U)
+		ctx->partial = (ctx->partial & ~(0xFFU << shift)) | ((uint32_t)*data++ << shift);
+	ctx->crc = CRC->DR;
+}
+
+void Flash_CRC32Fill(Flash_CRC32_t *ctx, uint32_t size)
+{
+	uint32_t head = (4U - (ctx->size & 3U)) & 3U;
+	// the open word already reads 0xFF past what was fed
+	if (size < head || size == 0)
+	{
+		ctx->size += size;
+		return;
+	}
+	crc_seed(ctx->crc);
+	if (head > 0)
+	{
+		CRC->DR = ctx->partial;
+		ctx->partial = ERASED_WORD;
+	}
+	ctx->size += head;
+	size -= head;
+	for (; size >= 4U; size -= 4U, ctx->size += 4U)
+		CRC->DR = ERASED_WORD;
+	ctx->size += size;
+	ctx->crc = CRC->DR;
+}
+
+uint32_t Flash_CRC32SlotValue(const Flash_CRC32_t *ctx)
+{
+	uint32_t words = (ctx->size + 3U) / 4U;
+	crc_seed(ctx->crc);
+	if (ctx->size & 3U)
+		CRC->DR = ctx->partial;
+	for (; words < APP_FLASH_SECTOR_SIZE / 4U; words++)
+		CRC->DR = ERASED_WORD;
+	return CRC->DR;
+}
+
+uint32_t Flash_CRC32Value(const Flash_CRC32_t *ctx)
+{
+	if (!(ctx->size & 3U))
+		return ctx->crc;
+	crc_seed(ctx->crc);
+	CRC->DR = ctx->partial;
+	return CRC->DR;
+}
+
+Flash_Status_t Flash_VerifyCRC32(uint32_t flash_addr, const Flash_CRC32_t *ctx)
+{
+	uint32_t crc = 0;
+	// the open word is compared with the erased bytes after it
+	uint32_t size = (ctx->size + 3U) & ~3U;
+	if (!Flash_ValidFlashAppMem(flash_addr) || size > APP_FLASH_SECTOR_SIZE)
+		return FLASH_APP_ERR;
+	if (Flash_CalculateCRC32Range(flash_addr, size, 1, &crc) != FLASH_APP_OK)
+		return FLASH_APP_ERR;
+	return (crc == Flash_CRC32Value(ctx)) ? FLASH_APP_OK : FLASH_APP_ERR;
+}
+
+uint8_t Flash_FoldCRC32(uint32_t crc)
+{
+	// calculated CRC is stored as 8 bit value so we XOR the 4 bytes of CRC with each other
+	return ((crc >> 24) & 0xFF) ^ ((crc >> 16) & 0xFF) ^ ((crc >> 8) & 0xFF) ^ (crc & 0xFF);
+}
+
 uint8_t Flash_GetSector(uint32_t flash_addr)
 {
 	if (flash_addr == BCKUP_APP_SLOT_ADDR)
@@ -0,0 +1,77 @@
+#include "image_trailer.h"
+
+/**
+ * @brief Calculates the CRC of every field before trailer_crc
+ *
+ * @param trailer image trailer
+ * @return uint32_t
+ */
+static uint32_t trailer_crc(const Image_Trailer_t *trailer)
+{
+	Flash_CRC32_t ctx;
+	Flash_CRC32Init(&ctx);
+	Flash_CRC32Update(&ctx, (const uint8_t *)trailer, offsetof(Image_Trailer_t, trailer_crc));
+	return Flash_CRC32Value(&ctx);
+}
+
+Image_Status_t Image_CheckTrailer(const Image_Trailer_t *trailer, uint32_t load_addr)
+{
+	if (trailer == NULL || trailer->magic != IMAGE_TRAILER_MAGIC)
+		return IMAGE_NO_TRAILER;
+	if (trailer->format != IMAGE_TRAILER_VERSION || trailer->size != IMAGE_TRAILER_SIZE ||
+		trailer->trailer_crc != trailer_crc(trailer))
+	{
+		printf("Image trailer is corrupted\r\n");
+		return IMAGE_ERR;
+	}
+	if (trailer->image_size == 0 || trailer->image_size > IMAGE_MAX_SIZE)
+	{
+		printf("Image size %lu does not fit the slot\r\n", (unsigned long)trailer->image_size);
+		return IMAGE_ERR;
+	}
+	if (trailer->load_addr != load_addr)
+	{
+		printf("Image is linked for 0x%08lX\r\n", (unsigned long)trailer->load_addr);
+		return IMAGE_ERR;
+	}
+	return IMAGE_OK;
+}
+
+Image_Status_t Image_GetTrailer(uint32_t slot_addr, uint32_t load_addr, Image_Trailer_t *trailer)
+{
+	if (!Flash_ValidFlashAppMem(slot_addr) || trailer == NULL)
+		return IMAGE_ERR;
+	memcpy(trailer, (const void *)(slot_addr + IMAGE_TRAILER_OFFSET), sizeof(*trailer));
+	return Image_CheckTrailer(trailer, load_addr);
+}
+
+Image_Status_t Image_Verify(uint32_t slot_addr, uint32_t load_addr, Image_Trailer_t *trailer)
+{
+	Image_Trailer_t slot_trailer;
+	uint32_t crc = 0;
+	if (trailer == NULL)
+		trailer = &slot_trailer;
+	Image_Status_t ret = Image_GetTrailer(slot_addr, load_addr, trailer);
+	if (ret != IMAGE_OK)
+		return ret;
+	// the bytes after the image in its last word are erased, the image CRC counts them as 0xFF
+	if (Flash_CalculateCRC32Range(slot_addr, (trailer->image_size + 3U) & ~3U, 1, &crc) != FLASH_APP_OK)
+		return IMAGE_ERR;
+	return (crc == trailer->image_crc) ? IMAGE_OK : IMAGE_ERR;
+}
+
+Image_Status_t Image_Copy(uint32_t src_addr, uint32_t dest_addr, uint32_t size)
+{
+	Image_Trailer_t trailer;
+	Image_Status_t status = Image_GetTrailer(src_addr, dest_addr, &trailer);
+	if (status == IMAGE_ERR)
+		return IMAGE_ERR;
+	if (status == IMAGE_OK)
+		size = trailer.image_size;
+	if (Flash_CopySector(src_addr, dest_addr, size) != FLASH_APP_OK)
+		return IMAGE_ERR;
+	if (status == IMAGE_OK &&
+		Flash_WriteDataAt(dest_addr, IMAGE_TRAILER_OFFSET, (uint8_t *)&trailer, sizeof(trailer)) != FLASH_APP_OK)
+		return IMAGE_ERR;
+	return IMAGE_OK;
+}
@@ -0,0 +1,153 @@
+#include "lz_decoder.h"
+#include <stdio.h>
+
+#define LZ_WINDOW_MASK (LZ_WINDOW_SIZE - 1U)
+#define LZ_NIBBLE_MAX 15U
+
+#if (LZ_WINDOW_SIZE & LZ_WINDOW_MASK) != 0 || (LZ_WINDOW_SIZE % LZ_FLUSH_SIZE) != 0
+#error "LZ_WINDOW_SIZE must be a power of 2 and a multiple of LZ_FLUSH_SIZE"
+#endif
+
+/**
+ * @brief Adds a decoded byte to the history and flushes the history block it completes
+ *
+ * @param dec decoder
+ * @param byte decoded byte
+ * @return LZ_Status_t
+ */
+static LZ_Status_t output_byte(LZ_Decoder_t *dec, uint8_t byte)
+{
+	if (dec->total_out >= dec->max_out)
+	{
+		printf("Decompressed image is bigger than %lu bytes\r\n", (unsigned long)dec->max_out);
+		return LZ_ERR;
+	}
+	dec->history[dec->pos] = byte;
+	dec->pos = (dec->pos + 1) & LZ_WINDOW_MASK;
+	dec->total_out++;
+	if ((dec->pos % LZ_FLUSH_SIZE) == 0)
+	{
+		// pos wrapped to 0 after the last block of the window
+		uint16_t block = (dec->pos == 0) ? LZ_WINDOW_SIZE - LZ_FLUSH_SIZE : dec->pos - LZ_FLUSH_SIZE;
+		dec->flushed = dec->pos;
+		return dec->flush(&dec->history[block], LZ_FLUSH_SIZE);
+	}
+	return LZ_OK;
+}
+
+/**
+ * @brief Copies a match from the history. Overlapping matches(offset < length) repeat the last
+ * offset bytes, so the copy has to go byte by byte.
+ *
+ * @param dec decoder
+ * @return LZ_Status_t
+ */
+static LZ_Status_t copy_match(LZ_Decoder_t *dec)
+{
+	if (dec->offset == 0 || dec->offset > LZ_WINDOW_SIZE || dec->offset > dec->total_out)
+	{
+		printf("Invalid match offset %u\r\n", dec->offset);
+		return LZ_ERR;
+	}
+	for (uint32_t i = 0; i < dec->match_len; i++)
+	{
+		if (output_byte(dec, dec->history[(dec->pos - dec->offset) & LZ_WINDOW_MASK]) != LZ_OK)
+			return LZ_ERR;
+	}
+	return LZ_OK;
+}
+
+void LZ_DecoderInit(LZ_Decoder_t *dec, uint32_t max_out, LZ_Flush_t flush)
+{
+	dec->pos = 0;
+	dec->flushed = 0;
+	dec->total_out = 0;
+	dec->max_out = max_out;
+	dec->literal_len = 0;
+	dec->match_len = 0;
+	dec->offset = 0;
+	dec->state = LZ_STATE_TOKEN;
+	dec->flush = flush;
+}
+
+LZ_Status_t LZ_Decode(LZ_Decoder_t *dec, const uint8_t *in, uint16_t size)
+{
+	uint16_t i = 0;
+	while (i < size)
+	{
+		uint8_t byte = in[i++];
+		switch (dec->state)
+		{
+		case LZ_STATE_TOKEN:
+			dec->literal_len = byte >> 4;
+			dec->match_len = (byte & LZ_NIBBLE_MAX) + LZ_MIN_MATCH;
+			if (dec->literal_len == LZ_NIBBLE_MAX)
+				dec->state = LZ_STATE_LITERAL_LEN;
+			else if (dec->literal_len > 0)
+				dec->state = LZ_STATE_LITERALS;
+			else
+				dec->state = LZ_STATE_OFFSET_LSB;
+			break;
+		case LZ_STATE_LITERAL_LEN:
+			dec->literal_len += byte;
+			if (byte != 0xFF)
+				dec->state = (dec->literal_len > 0) ? LZ_STATE_LITERALS : LZ_STATE_OFFSET_LSB;
+			break;
+		case LZ_STATE_LITERALS:
+			if (output_byte(dec, byte) != LZ_OK)
+				return LZ_ERR;
+			// the rest of the literals that are in this input go in one go
+			while (--dec->literal_len > 0 && i < size)
+			{
+				if (output_byte(dec, in[i++]) != LZ_OK)
+					return LZ_ERR;
+			}
+			if (dec->literal_len == 0)
+				dec->state = LZ_STATE_OFFSET_LSB;
+			break;
+		case LZ_STATE_OFFSET_LSB:
+			dec->offset = byte;
+			dec->state = LZ_STATE_OFFSET_MSB;
+			break;
+		case LZ_STATE_OFFSET_MSB:
+			dec->offset |= (uint16_t)byte << 8;
+			if (dec->match_len - LZ_MIN_MATCH == LZ_NIBBLE_MAX)
+			{
+				dec->state = LZ_STATE_MATCH_LEN;
+				break;
+			}
+			if (copy_match(dec) != LZ_OK)
+				return LZ_ERR;
+			dec->state = LZ_STATE_TOKEN;
+			break;
+		case LZ_STATE_MATCH_LEN:
+			dec->match_len += byte;
+			if (byte == 0xFF)
+				break;
+			if (copy_match(dec) != LZ_OK)
+				return LZ_ERR;
+			dec->state = LZ_STATE_TOKEN;
+			break;
+		default:
+			return LZ_ERR;
+		}
+	}
+	return LZ_OK;
+}
+
+LZ_Status_t LZ_DecoderFinish(LZ_Decoder_t *dec)
+{
+	// the last sequence only has literals so the stream stops where its offset would be
+	if (dec->state != LZ_STATE_OFFSET_LSB && dec->state != LZ_STATE_TOKEN)
+	{
+		printf("Compressed stream ended in the middle of a sequence\r\n");
+		return LZ_ERR;
+	}
+	if (dec->pos == dec->flushed)
+		return LZ_OK;
+	// pos is never 0 here since a full last block was already flushed by output_byte()
+	uint16_t size = dec->pos - dec->flushed;
+	uint16_t block = dec->flushed;
+	dec->flushed = dec->pos;
+	return dec->flush(&dec->history[block], size);
+}
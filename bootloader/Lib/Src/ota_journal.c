@@ -0,0 +1,123 @@
+#include "ota_journal.h"
+
+#define JOURNAL_RECORDS		 ((volatile Journal_Record_t *)APP_JOURNAL_ADDR)
+#define JOURNAL_MAX_RECORDS	 (APP_JOURNAL_SIZE / sizeof(Journal_Record_t))
+#define JOURNAL_RECORD_WORDS (sizeof(Journal_Record_t) / sizeof(uint32_t))
+
+/**
+ * @brief Calculates the check word of a record
+ *
+ * @param record journal record
+ * @return uint32_t
+ */
+static uint32_t record_check(const Journal_Record_t *record)
+{
+	return JOURNAL_MAGIC ^ record->image_crc ^ (record->next_seq | (uint32_t)record->image_mode << 16) ^
+		   record->write_offset ^ record->prefix_crc;
+}
+/**
+ * @brief Checks whether every word of a record slot is still erased
+ *
+ * @param index record slot
+ * @return uint8_t 1 if the slot is free
+ */
+static uint8_t record_free(uint32_t index)
+{
+	volatile uint32_t *words = (volatile uint32_t *)&JOURNAL_RECORDS[index];
+	for (uint32_t i = 0; i < JOURNAL_RECORD_WORDS; i++)
+	{
+		if (words[i] != 0xFFFFFFFFU)
+			return 0;
+	}
+	return 1;
+}
+/**
+ * @brief Finds the first free record slot and the newest valid record before it
+ *
+ * @param last pointer to store the newest valid record, can be NULL
+ * @param found set to 1 if there is a valid record
+ * @return uint32_t index of the first free slot(JOURNAL_MAX_RECORDS if the journal is full)
+ */
+static uint32_t scan_journal(Journal_Record_t *last, uint8_t *found)
+{
+	uint32_t index = 0;
+	*found = 0;
+	for (; index < JOURNAL_MAX_RECORDS && !record_free(index); index++)
+	{
+		Journal_Record_t record;
+		memcpy(&record, (const void *)&JOURNAL_RECORDS[index], sizeof(record));
+		if (record.check != record_check(&record))
+			continue;
+		if (last != NULL)
+			*last = record;
+		*found = 1;
+	}
+	return index;
+}
+/**
+ * @brief Programs a record into a free slot, the check word goes last
+ *
+ * @param index free record slot
+ * @param record record to write
+ * @return Journal_Status_t
+ */
+static Journal_Status_t write_record(uint32_t index, Journal_Record_t *record)
+{
+	uint32_t words[JOURNAL_RECORD_WORDS];
+	uint32_t addr = (uint32_t)&JOURNAL_RECORDS[index];
+	record->check = record_check(record);
+	memcpy(words, record, sizeof(words));
+	if (HAL_FLASH_Unlock() != HAL_OK)
+		return JOURNAL_ERR;
+	for (uint32_t i = 0; i < JOURNAL_RECORD_WORDS; i++)
+	{
+		if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, addr + i * sizeof(uint32_t), words[i]) != HAL_OK)
+		{
+			HAL_FLASH_Lock();
+			return JOURNAL_ERR;
+		}
+	}
+	HAL_FLASH_Lock();
+	return JOURNAL_OK;
+}
+
+Journal_Status_t Journal_Start(uint32_t image_crc, uint16_t image_mode)
+{
+	// records are written in order, a journal with its first slot free was cleared and needs no erase
+	if (!record_free(0) && Flash_EraseSector(APP_JOURNAL_FLASH_SECTOR, DEVICE_VOLTAGE_RANGE) != FLASH_APP_OK)
+		return JOURNAL_ERR;
+	// CRC of an empty prefix is the CRC peripheral reset value
+	Journal_Record_t record = {image_crc, 0, image_mode, 0, 0xFFFFFFFFU, 0};
+	return write_record(0, &record);
+}
+
+Journal_Status_t Journal_Append(uint16_t next_seq, uint32_t write_offset, uint32_t prefix_crc)
+{
+	Journal_Record_t record;
+	uint8_t found;
+	uint32_t index = scan_journal(&record, &found);
+	if (!found || index >= JOURNAL_MAX_RECORDS)
+		return JOURNAL_ERR;
+	record.next_seq = next_seq;
+	record.write_offset = write_offset;
+	record.prefix_crc = prefix_crc;
+	return write_record(index, &record);
+}
+
+Journal_Status_t Journal_GetLast(Journal_Record_t *record)
+{
+	uint8_t found;
+	if (record == NULL)
+		return JOURNAL_ERR;
+	scan_journal(record, &found);
+	return found ? JOURNAL_OK : JOURNAL_ERR;
+}
+
+Journal_Status_t Journal_Clear(void)
+{
+	if (record_free(0))
+		return JOURNAL_OK;
+	if (Flash_EraseSector(APP_JOURNAL_FLASH_SECTOR, DEVICE_VOLTAGE_RANGE) != FLASH_APP_OK)
+		return JOURNAL_ERR;
+	return JOURNAL_OK;
+}
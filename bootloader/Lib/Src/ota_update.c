@@ -1,178 +1,1215 @@
 #include "ota_update.h"
 
 extern UART_HandleTypeDef huart2;
+// One buffer per frame in the window plus the one the next frame is parsed into
+static OTA_DataFrame_t frame_pool[OTA_WINDOW_SIZE + 1];
+static OTA_DataFrame_t *free_buffs[OTA_WINDOW_SIZE + 1];
+static uint8_t free_count = 0;
+// Received frames waiting to be written to flash, frame seq is stored at index seq % OTA_WINDOW_SIZE
+static OTA_DataFrame_t *window[OTA_WINDOW_SIZE];
+// Frame currently being parsed
+static OTA_DataFrame_t *rx_df = NULL;
+// Every data frame before next_seq has been written to flash
+static uint16_t next_seq = 0;
+// Broken frames received since the window last moved forward
+static uint8_t num_of_retries = 0;
+// Kept between calls so the next frame can be parsed while the current one is being programmed
+static OTA_Parser_t rx_parser = {0};
+// Flash address, payload format and statistics of the current session
+static uint32_t session_app_addr = 0;
+// Slot that is not being written, it keeps the running image and is the base of a patch
+static uint32_t base_slot_addr = 0;
+// Address the image is linked to run from, the main slot unless its trailer says otherwise
+static uint32_t load_addr = MAIN_APP_SLOT_ADDR;
+static OTA_Image_Mode_t image_mode = OTA_IMAGE_MODE_RAW;
+static uint32_t bytes_received = 0;
+static uint32_t bytes_written = 0;
+// Offset into the slot the next byte of the image goes to
+static uint32_t write_offset = 0;
+// Running CRC of everything written to the slot, the slot CRC is known as soon as END DATA arrives
+static Flash_CRC32_t slot_crc;
+// CPU cycles spent in Flash_WriteDataAt(), counted with the DWT cycle counter
+static uint32_t program_cycles = 0;
+// CPU cycles spent checking frame CRCs
+static uint32_t crc_cycles = 0;
+// UART errors and ring overflows of the RX ring runs a baud rate change ended, the count of the
+// running one is added when the session is summed up
+static uint32_t uart_errors = 0;
+// Decompresses OTA_IMAGE_MODE_LZ images, the history window doubles as the program buffer
+static LZ_Decoder_t lz_dec;
+// Rebuilds OTA_IMAGE_MODE_DELTA images out of the base slot
+static Patch_Decoder_t patch_dec;
+// CRC the slot has to match at the end, sent in START DATA
+static uint32_t image_crc = 0;
+static uint8_t image_crc_valid = 0;
+// Size of an OTA_IMAGE_MODE_SYNC image, the gaps up to it are copied from the base slot
+static uint32_t sync_image_size = 0;
+// Progress goes to the journal so a raw download that gets cut off can be resumed
+static uint8_t journal_active = 0;
+// Set while the slot is erased in the background, data frames wait in the window until it is done
+static uint8_t slot_erasing = 0;
+static uint32_t erase_start_tick = 0;
+// Set when the erase was started before START DATA, the session is set up once it is done
+static uint8_t erase_ahead = 0;
+// Base CRC(see Slot Info Response) of the base slot, out of its trailer or read once it is asked for
+static uint32_t base_slot_crc = 0;
+static uint8_t base_crc_valid = 0;
+// Clock the baud rates are generated from, read up front since the RCC driver runs from flash
+static uint32_t pclk1_freq = 0;
+// Outcome of the last baud rate change, printed once the flash is not busy since printf runs from flash
+static const char *baud_log = NULL;
+static uint32_t baud_log_rate = 0;
+// Broken frames received while the flash was busy, logged the same way
+static const char *frame_log[OTA_FRAME_LOG_SIZE];
+static uint8_t frame_log_count = 0;
+// Slot the uploader asked to boot with BOOT SLOT
+static uint32_t boot_slot_addr = 0;
+
+// The frame CRC runs over Data Type to the end of Data in one go, so they have to be back to back
+_Static_assert(offsetof(OTA_DataFrame_t, data) == offsetof(OTA_DataFrame_t, data_type) + OTA_FRAME_HEADER_SIZE,
+			   "OTA_DataFrame_t header is padded");
 /**
- * @brief calculates a XOR checksum and checks it with the payload being sent from uploader
- * 
+ * @brief calculates the CRC-32 of the header and data with the CRC peripheral and checks it with
+ * the one being sent from uploader. The bytes are fed as little endian words, the last word is
+ * padded with zeros.
+ *
  * @param df DataFrame struct received from uploader
- * @return OTA_Status_t 
+ * @return OTA_Status_t
  */
-static OTA_Status_t checksum_verify(OTA_DataFrame_t *df)
+static RAMFUNC OTA_Status_t crc_verify(OTA_DataFrame_t *df)
 {
-	uint8_t checksum = df->data[0];
-	for (uint16_t i = 1; i < df->data_size; i++)
+	const uint8_t *bytes = &df->data_type;
+	uint32_t size = OTA_FRAME_HEADER_SIZE + df->data_size;
+	uint32_t word = 0;
+	uint32_t cycles = DWT->CYCCNT;
+	// enables RCC of CRC peripheral
+	__HAL_RCC_CRC_CLK_ENABLE();
+	CRC->CR |= CRC_CR_RESET;
+	// data starts at an odd address, memcpy turns into an unaligned word load
+	for (; size >= sizeof(word); size -= sizeof(word), bytes += sizeof(word))
+	{
+		memcpy(&word, bytes, sizeof(word));
+		CRC->DR = word;
+	}
+	if (size > 0)
 	{
-		checksum ^= df->data[i];
+		word = 0;
+		memcpy(&word, bytes, size);
+		CRC->DR = word;
 	}
-	return (checksum != df->crc) ? OTA_ERR : OTA_OK;
+	OTA_Status_t ret = (CRC->DR != df->crc) ? OTA_ERR : OTA_OK;
+	crc_cycles += DWT->CYCCNT - cycles;
+	return ret;
 }
 /**
- * @brief Sends one byte over through UART2
- * 
- * @param reponse Byte to send over
+ * @brief Sends the Ready Response through UART2
+ *
+ * @param erase_state OTA_ERASE_STATE_AHEAD if the slot is erased ahead of START DATA
  */
-static void send_byte_response(uint8_t reponse) { 
-	HAL_UART_Transmit(&huart2, &reponse, 1, HAL_MAX_DELAY); 
-	printf("\r\n");
+static RAMFUNC void send_ready_response(uint8_t erase_state)
+{
+	uint8_t response[4] = {OTA_BOOTLOADER_UPLOAD_READY, erase_state, '\r', '\n'};
+	HAL_UART_Transmit(&huart2, response, sizeof(response), HAL_MAX_DELAY);
 }
 /**
- * @brief Get the data frame from uploader via UART2
- * 
- * @param df pointer to data frame to store the received value
- * @return OTA_Status_t 
+ * @brief Sends the window status(cumulative ACK, selective ACK bitmap and window size) through UART2
+ *
+ * @param status OTA_STATUS_ACK or OTA_STATUS_NACK
  */
-static OTA_Status_t get_data_frame(OTA_DataFrame_t *df)
+static RAMFUNC void send_status_response(uint8_t status)
+{
+	uint8_t sack = 0;
+	for (uint8_t i = 0; i < OTA_WINDOW_SIZE - 1; i++)
+	{
+		if (window[(uint16_t)(next_seq + 1 + i) % OTA_WINDOW_SIZE] != NULL)
+			sack |= 1U << i;
+	}
+	uint8_t response[7] = {status, next_seq & 0xFF, next_seq >> 8, sack, OTA_WINDOW_SIZE, '\r', '\n'};
+	HAL_UART_Transmit(&huart2, response, sizeof(response), HAL_MAX_DELAY);
+}
+/**
+ * @brief Feeds the bytes waiting in the UART RX ring buffer into the frame parser.
+ * Returns as soon as a whole frame has been parsed or the ring buffer is empty.
+ *
+ * @param parser parser state, kept between calls so a frame can be split across calls
+ * @param df pointer to data frame to store the parsed values
+ * @return OTA_Parse_Result_t
+ */
+static RAMFUNC OTA_Parse_Result_t parse_rx_data(OTA_Parser_t *parser, OTA_DataFrame_t *df)
 {
-	static uint8_t num_of_retries = 0;
-	HAL_StatusTypeDef ret;
-	uint8_t error_detected = 0;
-	uint8_t num_of_sof_retries = 0;
 	uint8_t byte = 0;
-	while (num_of_retries <= MAX_RETRIES)
+	// a finished (or broken) frame is kept until get_data_frame() picks it up
+	if (parser->result != OTA_PARSE_INCOMPLETE)
+		return parser->result;
+	while (RxRing_Available() > 0)
 	{
-		error_detected = 0;
-		//looks for the SOF byte to sync messages
-		while(num_of_sof_retries <= MAX_SOF_RETRIES)
+		// data is copied in bulk straight from the ring buffer into the frame
+		if (parser->state == OTA_PARSE_DATA)
+		{
+			parser->data_pos += RxRing_ReadAvailable(&df->data[parser->data_pos], df->data_size - parser->data_pos);
+			if (parser->data_pos >= df->data_size)
+				parser->state = OTA_PARSE_CRC;
+			continue;
+		}
+		RxRing_ReadAvailable(&byte, 1);
+		switch (parser->state)
 		{
-			ret = HAL_UART_Receive(&huart2, &byte, 1, HAL_MAX_DELAY);
-			if (ret != HAL_OK)
+		case OTA_PARSE_SOF:
+			// looks for the SOF byte to sync messages, anything else is discarded
+			// v2 frames are still parsed so an old uploader can be told it is out of date
+			if (byte == OTA_SOF_V3 || byte == OTA_SOF_V2)
 			{
-				error_detected = 1;
+				df->sof = byte;
+				parser->state = OTA_PARSE_DATA_TYPE;
 			}
-			if(byte == OTA_SOF)
+			break;
+		case OTA_PARSE_DATA_TYPE:
+			df->data_type = byte;
+			parser->state = OTA_PARSE_SEQ_LSB;
+			break;
+		case OTA_PARSE_SEQ_LSB:
+			df->seq = byte;
+			parser->state = OTA_PARSE_SEQ_MSB;
+			break;
+		case OTA_PARSE_SEQ_MSB:
+			df->seq |= (uint16_t)byte << 8;
+			parser->state = OTA_PARSE_SIZE_LSB;
+			break;
+		case OTA_PARSE_SIZE_LSB:
+			df->data_size = byte;
+			parser->state = OTA_PARSE_SIZE_MSB;
+			break;
+		case OTA_PARSE_SIZE_MSB:
+			df->data_size |= (uint16_t)byte << 8;
+			if (df->data_size == 0 || df->data_size > MAX_DATA_SIZE)
 			{
-				df->sof = byte;
-				break;
+				parser->result = OTA_PARSE_ERR;
+				return parser->result;
 			}
+			parser->data_pos = 0;
+			parser->crc_pos = 0;
+			parser->state = OTA_PARSE_DATA;
+			break;
+		case OTA_PARSE_CRC:
+			// CRC is little endian, v2 frames have a 1 byte XOR checksum
+			if (parser->crc_pos == 0)
+				df->crc = 0;
+			df->crc |= (uint32_t)byte << (8 * parser->crc_pos++);
+			if (df->sof == OTA_SOF_V2 || parser->crc_pos >= sizeof(df->crc))
+				parser->state = OTA_PARSE_EOF;
+			break;
+		case OTA_PARSE_EOF:
+			df->eof = byte;
+			parser->state = OTA_PARSE_SOF;
+			parser->result = OTA_PARSE_FRAME_DONE;
+			return parser->result;
+		default:
+			parser->state = OTA_PARSE_SOF;
+			break;
 		}
-		//Gets data type byte
-		ret = HAL_UART_Receive(&huart2, &df->data_type, 1, HAL_MAX_DELAY);
-		if (ret != HAL_OK)
-		{
-			error_detected = 1;
-		}
-		//gets the data size(2 bytes)
-		ret = HAL_UART_Receive(&huart2, (uint8_t *)&df->data_size, 2, HAL_MAX_DELAY);
-		if (ret != HAL_OK)
-		{
-			error_detected = 1;
-		}
-		//printf("Size: %x\r\n", df->data_size);
-		//gets the data based on the data size
-		ret = HAL_UART_Receive(&huart2, df->data, df->data_size, HAL_MAX_DELAY);
-		if (ret != HAL_OK)
-		{
-			error_detected = 1;
-		}
-		//gets the crc calculated from the uploader
-		ret = HAL_UART_Receive(&huart2, &df->crc, 1, HAL_MAX_DELAY);
-		if (ret != HAL_OK)
+	}
+	return OTA_PARSE_INCOMPLETE;
+}
+/**
+ * @brief Logs a broken frame, or keeps the message for print_frame_log() while the flash is busy. printf
+ * runs from flash and would hold back the NACK until the erase is done.
+ *
+ * @param msg message to log
+ */
+static RAMFUNC void log_frame_error(const char *msg)
+{
+	if (Flash_EraseStatus() != FLASH_APP_BUSY)
+		printf("%s", msg);
+	else if (frame_log_count < OTA_FRAME_LOG_SIZE)
+		frame_log[frame_log_count++] = msg;
+}
+/**
+ * @brief Prints the broken frames log_frame_error() kept unless the flash is still busy
+ */
+static RAMFUNC void print_frame_log(void)
+{
+	if (frame_log_count == 0 || Flash_EraseStatus() == FLASH_APP_BUSY)
+		return;
+	for (uint8_t i = 0; i < frame_log_count; i++)
+		printf("%s", frame_log[i]);
+	frame_log_count = 0;
+}
+/**
+ * @brief Receives one frame from uploader via UART2. Continues from whatever part of the frame was
+ * already parsed while the previous frame was being programmed. Does not send any response.
+ *
+ * @param df pointer to data frame to store the received value
+ * @param timeout time in ms to wait for the start of the frame (HAL_MAX_DELAY waits forever)
+ * @return OTA_Status_t OTA_ERR if the frame is broken, OTA_TIMEOUT if no frame started in time
+ */
+static RAMFUNC OTA_Status_t receive_frame(OTA_DataFrame_t *df, uint32_t timeout)
+{
+	OTA_Parse_Result_t parse_ret;
+	RxRing_Status_t ret = RX_RING_OK;
+	print_frame_log();
+	parse_ret = parse_rx_data(&rx_parser, df);
+	while (parse_ret == OTA_PARSE_INCOMPLETE)
+	{
+		// waits for the start of a frame, but once a frame has started
+		// the line going idle for too long means bytes were lost
+		ret = RxRing_WaitData((rx_parser.state == OTA_PARSE_SOF) ? timeout : OTA_FRAME_TIMEOUT);
+		if (ret != RX_RING_OK)
+			break;
+		parse_ret = parse_rx_data(&rx_parser, df);
+	}
+	if (ret == RX_RING_TIMEOUT && rx_parser.state == OTA_PARSE_SOF)
+		return OTA_TIMEOUT;
+	// gets the parser ready for the next frame
+	rx_parser.state = OTA_PARSE_SOF;
+	rx_parser.result = OTA_PARSE_INCOMPLETE;
+	//checks if there has been any UART receive errors 
+	//or if eof has been received
+	//also checks the frame version and CRC
+	if (parse_ret != OTA_PARSE_FRAME_DONE)
+	{
+		log_frame_error("Transimission error detected\r\n");
+		return OTA_ERR;
+	}
+	if (df->eof != OTA_EOF)
+	{
+		log_frame_error("EOF error\r\n");
+		return OTA_ERR;
+	}
+	if (df->sof != OTA_SOF_V3)
+	{
+		log_frame_error("Frame version not supported, update firmware_upload.py\r\n");
+		return OTA_ERR;
+	}
+	if (crc_verify(df) != OTA_OK)
+	{
+		log_frame_error("CRC error\r\n");
+		return OTA_ERR;
+	}
+	return OTA_OK;
+}
+/**
+ * @brief Get the next valid data frame from uploader via UART2. Broken frames are NACKed
+ * here, the caller sends the ACK once it is done with the frame.
+ * 
+ * @param df pointer to data frame to store the received value
+ * @param timeout time in ms to wait for the start of a frame (HAL_MAX_DELAY waits forever)
+ * @return OTA_Status_t OTA_TIMEOUT if no frame started in time
+ */
+static RAMFUNC OTA_Status_t get_data_frame(OTA_DataFrame_t *df, uint32_t timeout)
+{
+	while (num_of_retries <= MAX_RETRIES)
+	{
+		OTA_Status_t ret = receive_frame(df, timeout);
+		if (ret != OTA_ERR)
+			return ret;
+		//Sends NACK if the data frame is not valid and then looks
+		//for the next frame. The uploader only resends the missing ones
+		num_of_retries++;
+		send_status_response(OTA_STATUS_NACK);
+	}
+	return OTA_ERR;
+}
+/**
+ * @brief Discards received bytes until the line has been idle for OTA_FRAME_TIMEOUT
+ */
+static RAMFUNC void flush_until_idle(void)
+{
+	uint8_t discard[32];
+	while (RxRing_WaitData(OTA_FRAME_TIMEOUT) != RX_RING_TIMEOUT)
+	{
+		while (RxRing_ReadAvailable(discard, sizeof(discard)) > 0)
+			;
+	}
+}
+/**
+ * @brief Reprograms the USART2 baud rate register. Uses 16x oversampling when the rate allows
+ * it and 8x oversampling (OVER8) above PCLK1/16.
+ *
+ * @param baud_rate new baud rate
+ * @param apply 0 to only check if the rate can be generated
+ * @return OTA_Status_t OTA_ERR if the rate can't be generated within OTA_BAUD_MAX_ERROR percent
+ */
+static RAMFUNC OTA_Status_t uart_set_baud_rate(uint32_t baud_rate, uint8_t apply)
+{
+	uint32_t pclk = pclk1_freq;
+	uint32_t brr, actual_baud, baud_err;
+	uint8_t over8 = 0;
+	if (baud_rate == 0 || baud_rate > pclk / 8U)
+		return OTA_ERR;
+	if (baud_rate <= pclk / 16U)
+	{
+		brr = UART_BRR_SAMPLING16(pclk, baud_rate);
+		actual_baud = pclk / brr;
+	}
+	else
+	{
+		over8 = 1;
+		brr = UART_BRR_SAMPLING8(pclk, baud_rate);
+		// with OVER8 the fraction is 3 bits and bit 3 is unused
+		actual_baud = pclk / (((brr & 0xFFF0U) >> 1) | (brr & 0x07U));
+	}
+	baud_err = (actual_baud > baud_rate) ? actual_baud - baud_rate : baud_rate - actual_baud;
+	if (baud_err * 100U > baud_rate * OTA_BAUD_MAX_ERROR)
+		return OTA_ERR;
+	if (!apply)
+		return OTA_OK;
+	// waits for the last byte to leave the shift register before changing the rate
+	while (__HAL_UART_GET_FLAG(&huart2, UART_FLAG_TC) == RESET)
+		;
+	__HAL_UART_DISABLE(&huart2);
+	MODIFY_REG(huart2.Instance->CR1, USART_CR1_OVER8, over8 ? USART_CR1_OVER8 : 0U);
+	huart2.Instance->BRR = brr;
+	__HAL_UART_ENABLE(&huart2);
+	huart2.Init.BaudRate = baud_rate;
+	huart2.Init.OverSampling = over8 ? UART_OVERSAMPLING_8 : UART_OVERSAMPLING_16;
+	return OTA_OK;
+}
+/**
+ * @brief Switches the UART to a new baud rate with the RX ring buffer restarted around it
+ *
+ * @param baud_rate new baud rate
+ */
+static RAMFUNC void switch_baud_rate(uint32_t baud_rate)
+{
+	uart_errors += RxRing_GetErrorCount();
+	RxRing_Stop();
+	uart_set_baud_rate(baud_rate, 1);
+	RxRing_Start(&huart2);
+	rx_parser.state = OTA_PARSE_SOF;
+	rx_parser.result = OTA_PARSE_INCOMPLETE;
+}
+/**
+ * @brief Checks the link probe payload against the pattern the uploader generates, every byte value
+ * is sent once per 256 bytes.
+ *
+ * @param df link probe frame
+ * @return OTA_Status_t
+ */
+static RAMFUNC OTA_Status_t link_probe_verify(OTA_DataFrame_t *df)
+{
+	if (df->data_type != OTA_DATA_TYPE_LINK_PROBE || df->data_size != OTA_LINK_PROBE_SIZE)
+		return OTA_ERR;
+	for (uint16_t i = 0; i < df->data_size; i++)
+	{
+		if (df->data[i] != OTA_LINK_PROBE_BYTE(i))
+			return OTA_ERR;
+	}
+	return OTA_OK;
+}
+/**
+ * @brief Handles a SET BAUD frame. The ACK goes out at the old rate, then the new rate has to carry
+ * OTA_LINK_PROBE_COUNT link probes cleanly within OTA_BAUD_CONFIRM_TIMEOUT each. Otherwise the
+ * bootloader falls back to OTA_DEFAULT_BAUD, which is what the uploader does as well when it does
+ * not get the probe ACKs. The outcome is printed by print_baud_log().
+ *
+ * @param df SET BAUD frame, Data is the new baud rate(4 bytes)
+ */
+static RAMFUNC void change_baud_rate(OTA_DataFrame_t *df)
+{
+	uint32_t baud_rate = 0;
+	if (df->data_size == sizeof(baud_rate))
+		memcpy(&baud_rate, df->data, sizeof(baud_rate));
+	if (baud_rate == 0 || uart_set_baud_rate(baud_rate, 0) != OTA_OK)
+	{
+		baud_log = "Unsupported baud rate %lu\r\n";
+		baud_log_rate = baud_rate;
+		send_status_response(OTA_STATUS_NACK);
+		return;
+	}
+	send_status_response(OTA_STATUS_ACK);
+	switch_baud_rate(baud_rate);
+	for (uint8_t i = 0; i < OTA_LINK_PROBE_COUNT; i++)
+	{
+		if (receive_frame(df, OTA_BAUD_CONFIRM_TIMEOUT) != OTA_OK || link_probe_verify(df) != OTA_OK)
 		{
-			error_detected = 1;
+			// whatever the uploader still sends at the failed rate is garbage at the old one
+			switch_baud_rate(OTA_DEFAULT_BAUD);
+			flush_until_idle();
+			baud_log = "Link probe failed, baud rate set to %lu\r\n";
+			baud_log_rate = OTA_DEFAULT_BAUD;
+			return;
 		}
-		//gets eof for sync
-		ret = HAL_UART_Receive(&huart2, &df->eof, 1, HAL_MAX_DELAY);
-		if (ret != HAL_OK)
+		send_status_response(OTA_STATUS_ACK);
+	}
+	baud_log = "Baud rate set to %lu\r\n";
+	baud_log_rate = baud_rate;
+}
+/**
+ * @brief Prints the outcome of the last baud rate change unless the slot is being erased, printf runs
+ * from flash and would stall the handshake until the erase is done
+ */
+static RAMFUNC void print_baud_log(void)
+{
+	if (baud_log == NULL || Flash_EraseStatus() == FLASH_APP_BUSY)
+		return;
+	printf(baud_log, (unsigned long)baud_log_rate);
+	baud_log = NULL;
+}
+/**
+ * @brief Gets the Base CRC of a base slot without a trailer, the whole slot is read the first time it
+ * is needed instead of at every session start
+ */
+static void base_crc_update(void)
+{
+	if (base_crc_valid)
+		return;
+	Flash_CalculateCRC32(base_slot_addr, &base_slot_crc);
+	base_crc_valid = 1;
+}
+/**
+ * @brief Sends the CRC of the base slot and the address of the slot being written through UART2
+ */
+static RAMFUNC void send_slot_info(void)
+{
+	uint32_t crc = base_slot_crc;
+	uint8_t response[11] = {OTA_SLOT_INFO,
+						   crc & 0xFF,
+						   (crc >> 8) & 0xFF,
+						   (crc >> 16) & 0xFF,
+						   crc >> 24,
+						   session_app_addr & 0xFF,
+						   (session_app_addr >> 8) & 0xFF,
+						   (session_app_addr >> 16) & 0xFF,
+						   session_app_addr >> 24,
+						   '\r',
+						   '\n'};
+	HAL_UART_Transmit(&huart2, response, sizeof(response), HAL_MAX_DELAY);
+}
+/**
+ * @brief Gets the Slot Image fields of the Image Info Response for a slot. An image with a trailer is
+ * read back and checked against it, anything else is described by the CRC of the whole slot.
+ *
+ * @param slot_addr [ @ref APP_SLOT_ADDR ]
+ * @param info pointer to store the 16 bytes
+ */
+static void get_slot_image(uint32_t slot_addr, uint8_t *info)
+{
+	const Image_Trailer_t *slot_trailer = (const Image_Trailer_t *)(slot_addr + IMAGE_TRAILER_OFFSET);
+	Image_Trailer_t trailer;
+	uint32_t fields[4] = {0, 0, MAIN_APP_SLOT_ADDR, 0};
+	//the image is checked against the load address its own trailer claims
+	if (Image_Verify(slot_addr, slot_trailer->load_addr, &trailer) == IMAGE_OK)
+	{
+		fields[0] = trailer.image_size;
+		fields[1] = trailer.image_crc;
+		fields[2] = trailer.load_addr;
+		fields[3] = trailer.version;
+	}
+	else
+		Flash_CalculateCRC32(slot_addr, &fields[1]);
+	memcpy(info, fields, sizeof(fields));
+}
+/**
+ * @brief Sends the active slot and the image each slot holds through UART2
+ */
+static void send_image_info(void)
+{
+	uint8_t response[39] = {OTA_IMAGE_INFO};
+	memcpy(&response[1], &base_slot_addr, sizeof(base_slot_addr));
+	get_slot_image(MAIN_APP_SLOT_ADDR, &response[5]);
+	get_slot_image(BCKUP_APP_SLOT_ADDR, &response[21]);
+	response[37] = '\r';
+	response[38] = '\n';
+	HAL_UART_Transmit(&huart2, response, sizeof(response), HAL_MAX_DELAY);
+}
+/**
+ * @brief Sends the CRC of every OTA_SYNC_BLOCK_SIZE block of the base slot through UART2, each one as
+ * soon as it is calculated so no buffer is needed
+ */
+static void send_block_hashes(void)
+{
+	uint8_t header[5] = {OTA_BLOCK_HASHES, OTA_SYNC_BLOCK_SIZE & 0xFF, OTA_SYNC_BLOCK_SIZE >> 8,
+						 OTA_SYNC_BLOCK_COUNT & 0xFF, OTA_SYNC_BLOCK_COUNT >> 8};
+	uint8_t line_end[2] = {'\r', '\n'};
+	HAL_UART_Transmit(&huart2, header, sizeof(header), HAL_MAX_DELAY);
+	for (uint32_t offset = 0; offset < APP_FLASH_SECTOR_SIZE; offset += OTA_SYNC_BLOCK_SIZE)
+	{
+		uint32_t crc = 0;
+		Flash_CalculateCRC32Range(base_slot_addr + offset, OTA_SYNC_BLOCK_SIZE, 1, &crc);
+		HAL_UART_Transmit(&huart2, (uint8_t *)&crc, sizeof(crc), HAL_MAX_DELAY);
+	}
+	HAL_UART_Transmit(&huart2, line_end, sizeof(line_end), HAL_MAX_DELAY);
+}
+/**
+ * @brief Checks the slot a BOOT SLOT frame asks for. The active slot is left to the boot checks, the
+ * slot being written has to hold an image with a trailer that runs from it.
+ *
+ * @param df BOOT SLOT frame
+ * @return OTA_Status_t
+ */
+static OTA_Status_t boot_slot_check(OTA_DataFrame_t *df)
+{
+	uint32_t slot_addr = 0;
+	if (df->data_size != 5)
+		return OTA_ERR;
+	memcpy(&slot_addr, &df->data[1], sizeof(slot_addr));
+	if (slot_addr != base_slot_addr &&
+		(slot_addr != session_app_addr || Image_Verify(slot_addr, slot_addr, NULL) != IMAGE_OK))
+	{
+		printf("Slot 0x%08lX can't be booted as it is\r\n", (unsigned long)slot_addr);
+		return OTA_ERR;
+	}
+	boot_slot_addr = slot_addr;
+	return OTA_OK;
+}
+/**
+ * @brief Writes a slice of the image to flash and keeps parsing the next frame out of the UART RX
+ * ring buffer after it
+ *
+ * @param data image data
+ * @param size number of bytes, at most OTA_PROGRAM_SLICE_SIZE so the ring buffer is drained often
+ * @return OTA_Status_t
+ */
+static OTA_Status_t program_slice(uint8_t *data, uint16_t size)
+{
+	//a DATA AT gap is left erased
+	Flash_CRC32Fill(&slot_crc, write_offset - slot_crc.size);
+	Flash_CRC32Update(&slot_crc, data, size);
+	uint32_t cycles = DWT->CYCCNT;
+	if (Flash_WriteDataAt(session_app_addr, write_offset, data, size) != FLASH_APP_OK)
+		return OTA_ERR;
+	program_cycles += DWT->CYCCNT - cycles;
+	write_offset += size;
+	bytes_written += size;
+	parse_rx_data(&rx_parser, rx_df);
+	return OTA_OK;
+}
+// Output callbacks of the decoders
+static LZ_Status_t lz_flush(uint8_t *data, uint16_t size)
+{
+	return (program_slice(data, size) == OTA_OK) ? LZ_OK : LZ_ERR;
+}
+static Patch_Status_t patch_output(uint8_t *data, uint16_t size)
+{
+	return (program_slice(data, size) == OTA_OK) ? PATCH_OK : PATCH_ERR;
+}
+/**
+ * @brief Fills the slot up to an offset with the bytes at the same offset of the base slot, the
+ * blocks of an OTA_IMAGE_MODE_SYNC image that did not change
+ *
+ * @param end_offset offset in the slot to copy up to
+ * @return OTA_Status_t
+ */
+static OTA_Status_t copy_from_base(uint32_t end_offset)
+{
+	if (end_offset > sync_image_size)
+	{
+		printf("DATA AT offset is past the end of the image\r\n");
+		return OTA_ERR;
+	}
+	while (write_offset < end_offset)
+	{
+		uint32_t slice_size = end_offset - write_offset;
+		if (slice_size > OTA_PROGRAM_SLICE_SIZE)
+			slice_size = OTA_PROGRAM_SLICE_SIZE;
+		//the base slot is memory mapped, the slice is programmed straight from it
+		if (program_slice((uint8_t *)(base_slot_addr + write_offset), slice_size) != OTA_OK)
+			return OTA_ERR;
+	}
+	return OTA_OK;
+}
+/**
+ * @brief Writes a data frame to flash in slices. Compressed frames and patches are decoded on the
+ * way and handed to program_slice() by the decoder.
+ *
+ * @param df data frame to write to flash
+ * @return OTA_Status_t
+ */
+static OTA_Status_t commit_data_frame(OTA_DataFrame_t *df)
+{
+	uint16_t slice_size;
+	uint16_t offset = 0;
+	bytes_received += df->data_size;
+	if (image_mode == OTA_IMAGE_MODE_LZ)
+		return (LZ_Decode(&lz_dec, df->data, df->data_size) == LZ_OK) ? OTA_OK : OTA_ERR;
+	if (image_mode == OTA_IMAGE_MODE_DELTA)
+		return (Patch_Decode(&patch_dec, df->data, df->data_size) == PATCH_OK) ? OTA_OK : OTA_ERR;
+	if (df->data_type == OTA_DATA_TYPE_DATA_AT)
+	{
+		uint32_t frame_offset = 0;
+		offset = sizeof(frame_offset);
+		if (df->data_size <= offset)
+			return OTA_ERR;
+		memcpy(&frame_offset, df->data, sizeof(frame_offset));
+		//the gap in between is left erased(or copied from the base slot), flash can't be written twice
+		if (frame_offset < write_offset)
 		{
-			error_detected = 1;
+			printf("DATA AT offset goes backwards\r\n");
+			return OTA_ERR;
 		}
-		//checks if there has been any UART receive errors 
-		//or if eof has been received
-		//also checks if checksum is valid
-		//Sends NACK if the data frame is not valid and then retries
-		if (df->eof != OTA_EOF ||  checksum_verify(df) != OTA_OK || error_detected)
+		if (image_mode == OTA_IMAGE_MODE_SYNC && copy_from_base(frame_offset) != OTA_OK)
+			return OTA_ERR;
+		write_offset = frame_offset;
+	}
+	for (; offset < df->data_size; offset += slice_size)
+	{
+		slice_size = df->data_size - offset;
+		if (slice_size > OTA_PROGRAM_SLICE_SIZE)
+			slice_size = OTA_PROGRAM_SLICE_SIZE;
+		if (program_slice(&df->data[offset], slice_size) != OTA_OK)
+			return OTA_ERR;
+	}
+	return OTA_OK;
+}
+/**
+ * @brief Picks up a download that was cut off if the journal holds progress for the same image. The
+ * part of the slot the journal covers has to match its CRC.
+ *
+ * @return OTA_Status_t OTA_ERR if the download has to start over
+ */
+static OTA_Status_t session_resume(void)
+{
+	Journal_Record_t record;
+	uint32_t crc = 0;
+	if (Journal_GetLast(&record) != JOURNAL_OK || record.image_crc != image_crc || record.image_mode != image_mode ||
+		record.write_offset > APP_FLASH_SECTOR_SIZE)
+		return OTA_ERR;
+	if (Flash_CalculateCRC32Range(session_app_addr, record.write_offset & ~3U, 1, &crc) != FLASH_APP_OK ||
+		crc != record.prefix_crc)
+	{
+		printf("Saved progress does not match the slot\r\n");
+		return OTA_ERR;
+	}
+	next_seq = record.next_seq;
+	write_offset = record.write_offset;
+	//carries on from the CRC the journal holds, the bytes of the last word come from flash
+	slot_crc.crc = record.prefix_crc;
+	slot_crc.size = write_offset & ~3U;
+	Flash_CRC32Update(&slot_crc, (const uint8_t *)(session_app_addr + slot_crc.size), write_offset & 3U);
+	printf("Resuming download at frame %u\r\n", next_seq);
+	return OTA_OK;
+}
+/**
+ * @brief Saves the progress to the journal after a frame was committed. The prefix CRC is the running
+ * CRC of the whole words written so far.
+ */
+static void session_checkpoint(void)
+{
+	if (!journal_active)
+		return;
+	//a full journal only means the download can't be resumed from here on
+	Journal_Append(next_seq, write_offset, slot_crc.crc);
+}
+/**
+ * @brief Resets the statistics and the running CRC of the session and sets up the decoder for its image
+ * mode. Runs from flash, with the slot being erased it is left until the erase is done.
+ */
+static void session_setup(void)
+{
+	bytes_received = 0;
+	bytes_written = 0;
+	write_offset = 0;
+	Flash_CRC32Init(&slot_crc);
+	program_cycles = 0;
+	crc_cycles = 0;
+	//starts the DWT cycle counter to time flash programming and CRC checks
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	if (image_mode == OTA_IMAGE_MODE_LZ)
+		LZ_DecoderInit(&lz_dec, APP_FLASH_SECTOR_SIZE, lz_flush);
+	//the patch is read from the slot that is not being written
+	if (image_mode == OTA_IMAGE_MODE_DELTA)
+		Patch_DecoderInit(&patch_dec, base_slot_addr, APP_FLASH_SECTOR_SIZE, APP_FLASH_SECTOR_SIZE, patch_output);
+}
+/**
+ * @brief Starts erasing the slot in the background, session_finish_erase() picks it up once it is done
+ *
+ * @return OTA_Status_t
+ */
+static RAMFUNC OTA_Status_t session_erase_start(void)
+{
+	if (Flash_EraseSectorStart(Flash_GetSector(session_app_addr), DEVICE_VOLTAGE_RANGE) != FLASH_APP_OK)
+	{
+		printf("Error erasing flash\r\n");
+		return OTA_ERR;
+	}
+	slot_erasing = 1;
+	erase_start_tick = HAL_GetTick();
+	return OTA_OK;
+}
+/**
+ * @brief Sets up the session for the image mode requested by START DATA. Erases the slot unless it is
+ * already being erased or a download of the same image is resumed.
+ *
+ * @param df START DATA frame
+ * @return OTA_Status_t OTA_ERR if the image mode is not supported or the slot can't be erased
+ */
+static RAMFUNC OTA_Status_t session_start(OTA_DataFrame_t *df)
+{
+	uint8_t mode = (df->data_size >= 2) ? df->data[1] : OTA_IMAGE_MODE_RAW;
+	if (mode != OTA_IMAGE_MODE_RAW && mode != OTA_IMAGE_MODE_LZ && mode != OTA_IMAGE_MODE_DELTA &&
+		mode != OTA_IMAGE_MODE_SYNC)
+	{
+		printf("Unsupported image mode %u\r\n", mode);
+		return OTA_ERR;
+	}
+	image_mode = (OTA_Image_Mode_t)mode;
+	image_crc_valid = 0;
+	journal_active = 0;
+	load_addr = MAIN_APP_SLOT_ADDR;
+	//both are built on the base slot, a sync also has the size of the image
+	if (image_mode == OTA_IMAGE_MODE_DELTA || image_mode == OTA_IMAGE_MODE_SYNC)
+	{
+		uint32_t base_crc = 0;
+		if (df->data_size != ((image_mode == OTA_IMAGE_MODE_SYNC) ? 14 : 10))
+			return OTA_ERR;
+		memcpy(&image_crc, &df->data[2], sizeof(image_crc));
+		memcpy(&base_crc, &df->data[6], sizeof(base_crc));
+		image_crc_valid = 1;
+		if (base_crc != base_slot_crc)
 		{
-			num_of_retries++;
-			if(df->eof != OTA_EOF)
-				printf("EOF error\r\n");
-			if(checksum_verify(df) != OTA_OK)
-				printf("Checksum error\r\n");
-			if(error_detected)
-				printf("Transimission error detected\r\n");
-			send_byte_response(OTA_NACK);
+			printf("Base CRC does not match the base slot\r\n");
+			return OTA_ERR;
 		}
-		else
+		if (image_mode == OTA_IMAGE_MODE_SYNC)
 		{
-			//Sends ACK of Data frame is valid and the
-			//data type is not START DATA
-			//This is because we want to ACK after
-			//we erase the flash
-			//if we erase the flash after we ack there will be data
-			//loss
-			if(df->data_type != OTA_DATA_TYPE_START_DATA)
-				send_byte_response(OTA_ACK);
-			break;
+			memcpy(&sync_image_size, &df->data[10], sizeof(sync_image_size));
+			if (sync_image_size > IMAGE_MAX_SIZE)
+				return OTA_ERR;
 		}
 	}
-	if (num_of_retries > MAX_RETRIES)
+	//raw frames don't depend on each other so a raw image with a CRC can be resumed
+	if (image_mode == OTA_IMAGE_MODE_RAW && df->data_size >= 6)
+	{
+		memcpy(&image_crc, &df->data[2], sizeof(image_crc));
+		image_crc_valid = 1;
+		journal_active = 1;
+	}
+	//a slot erased ahead of START DATA has nothing to resume, the setup waits for the end of the erase
+	if (erase_ahead)
+		return OTA_OK;
+	session_setup();
+	if (journal_active && session_resume() == OTA_OK)
+		return OTA_OK;
+	//the slot is erased in the background while the first data frames come in
+	printf("Download starting erasing flash\r\n");
+	return session_erase_start();
+}
+/**
+ * @brief Finishes the background erase of the slot once the flash is done with it and sets up a session
+ * that started during an erase ahead of START DATA. The slot is erased before the journal is restarted,
+ * a journal that is left over from a power loss in between fails the CRC check in session_resume().
+ *
+ * @return OTA_Status_t OTA_TIMEOUT while the erase is still running
+ */
+static RAMFUNC OTA_Status_t session_finish_erase(void)
+{
+	if (!slot_erasing)
+		return OTA_OK;
+	Flash_Status_t ret = Flash_EraseStatus();
+	if (ret == FLASH_APP_BUSY)
+		return OTA_TIMEOUT;
+	slot_erasing = 0;
+	if (ret != FLASH_APP_OK)
+	{
+		printf("Error erasing flash\r\n");
 		return OTA_ERR;
+	}
+	uint8_t buffered = 0;
+	for (uint8_t i = 0; i < OTA_WINDOW_SIZE; i++)
+		buffered += (window[i] != NULL);
+	printf("Slot erased in %lu ms, %u frames received meanwhile\r\n", (unsigned long)(HAL_GetTick() - erase_start_tick),
+		   buffered);
+	print_baud_log();
+	print_frame_log();
+	if (erase_ahead)
+		session_setup();
+	if (journal_active && Journal_Start(image_crc, image_mode) != JOURNAL_OK)
+		journal_active = 0;
+	else if (!journal_active)
+		Journal_Clear();
 	return OTA_OK;
 }
-
-OTA_Status_t ota_download_and_flash(uint32_t app_addr)
+/**
+ * @brief Writes what is left in the decoder to flash and prints the size and speed of the download.
+ * What was written is read back and checked against the running CRC, and the slot against the
+ * image CRC if START DATA had one. Nothing has been committed before that.
+ *
+ * @param start_tick HAL tick the first data frame was expected at
+ * @return OTA_Status_t
+ */
+static OTA_Status_t session_finish(uint32_t start_tick)
 {
-	//checks to make sure app_addr is a valid app SLOT#
-	if(!Flash_ValidFlashAppMem(app_addr))
+	if (image_mode == OTA_IMAGE_MODE_LZ && LZ_DecoderFinish(&lz_dec) != LZ_OK)
+		return OTA_ERR;
+	if (image_mode == OTA_IMAGE_MODE_DELTA && Patch_DecoderFinish(&patch_dec) != PATCH_OK)
+		return OTA_ERR;
+	//the blocks after the last one that changed
+	if (image_mode == OTA_IMAGE_MODE_SYNC && copy_from_base(sync_image_size) != OTA_OK)
+		return OTA_ERR;
+	//only the part of the slot that was written is read back, the rest is still erased
+	if (Flash_VerifyCRC32(session_app_addr, &slot_crc) != FLASH_APP_OK)
 	{
-		printf("Invalid Flash Address\r\n");
+		printf("Flash read back does not match what was written\r\n");
+		Journal_Clear();
+		return OTA_ERR;
+	}
+	if (image_crc_valid && Flash_CRC32SlotValue(&slot_crc) != image_crc)
+	{
+		printf("Image CRC mismatch\r\n");
+		//resuming would only end up with the same image
+		Journal_Clear();
+		return OTA_ERR;
+	}
+	uint32_t elapsed = HAL_GetTick() - start_tick;
+	if (elapsed == 0)
+		elapsed = 1;
+	printf("Received %lu bytes, wrote %lu bytes\r\n", (unsigned long)bytes_received, (unsigned long)bytes_written);
+	if (image_mode != OTA_IMAGE_MODE_RAW && bytes_received > 0)
+		printf("Compression ratio %lu.%02lu\r\n", (unsigned long)(bytes_written / bytes_received),
+			   (unsigned long)((bytes_written % bytes_received) * 100U / bytes_received));
+	printf("%lu ms, %lu bytes/s written\r\n", (unsigned long)elapsed,
+		   (unsigned long)((uint64_t)bytes_written * 1000U / elapsed));
+	//time one full data frame takes to program, the slices add up to it
+	uint32_t cycles_per_us = SystemCoreClock / 1000000U;
+	if (bytes_written > 0)
+		printf("Programming: %lu us total, %lu us per %u bytes\r\n", (unsigned long)(program_cycles / cycles_per_us),
+			   (unsigned long)((uint64_t)program_cycles * MAX_DATA_SIZE / bytes_written / cycles_per_us), MAX_DATA_SIZE);
+	printf("Checksum: %lu us total\r\n", (unsigned long)(crc_cycles / cycles_per_us));
+	printf("UART errors: %lu\r\n", (unsigned long)(uart_errors + RxRing_GetErrorCount()));
+	return OTA_OK;
+}
+/**
+ * @brief Checks the image trailer END DATA carries against the image that was written and programs it
+ * into the end of the slot. The running CRC is carried on over it so it still covers the whole slot.
+ *
+ * @param df END DATA frame, the trailer follows the END DATA byte
+ * @return OTA_Status_t OTA_ERR if the trailer does not describe the image or can't be written
+ */
+static OTA_Status_t session_write_trailer(OTA_DataFrame_t *df)
+{
+	Image_Trailer_t trailer;
+	Flash_CRC32_t image;
+	uint32_t trailer_load_addr;
+	const void *slot_trailer = (const void *)(session_app_addr + IMAGE_TRAILER_OFFSET);
+	if (df->data_size != 1 + sizeof(trailer))
+		return OTA_ERR;
+	memcpy(&trailer, &df->data[1], sizeof(trailer));
+	//an image linked for the slot it is written to runs from there, one linked for the main slot
+	//is copied there after the download
+	trailer_load_addr = (trailer.load_addr == session_app_addr) ? session_app_addr : MAIN_APP_SLOT_ADDR;
+	if (Image_CheckTrailer(&trailer, trailer_load_addr) != IMAGE_OK)
+		return OTA_ERR;
+	//everything that was written has to be part of the image
+	if (trailer.image_size < slot_crc.size)
+	{
+		printf("Image is larger than its trailer says\r\n");
 		return OTA_ERR;
 	}
-	OTA_DataFrame_t df = {0};
+	image = slot_crc;
+	Flash_CRC32Fill(&image, trailer.image_size - image.size);
+	if (Flash_CRC32Value(&image) != trailer.image_crc)
+	{
+		printf("Image CRC does not match its trailer\r\n");
+		return OTA_ERR;
+	}
+	//a resumed download can end with the trailer already in flash
+	if (memcmp(slot_trailer, &trailer, sizeof(trailer)) != 0)
+	{
+		if (Flash_WriteDataAt(session_app_addr, IMAGE_TRAILER_OFFSET, (uint8_t *)&trailer, sizeof(trailer)) !=
+				FLASH_APP_OK ||
+			memcmp(slot_trailer, &trailer, sizeof(trailer)) != 0)
+		{
+			printf("Error writing image trailer\r\n");
+			return OTA_ERR;
+		}
+	}
+	Flash_CRC32Fill(&slot_crc, IMAGE_TRAILER_OFFSET - slot_crc.size);
+	Flash_CRC32Update(&slot_crc, (const uint8_t *)&trailer, sizeof(trailer));
+	load_addr = trailer_load_addr;
+	printf("Image v%lu.%lu.%lu, %lu bytes\r\n", (unsigned long)IMAGE_VERSION_MAJOR(trailer.version),
+		   (unsigned long)IMAGE_VERSION_MINOR(trailer.version), (unsigned long)IMAGE_VERSION_PATCH(trailer.version),
+		   (unsigned long)trailer.image_size);
+	return OTA_OK;
+}
+/**
+ * @brief Empties the window and puts every frame buffer back in the free list
+ */
+static void window_reset(void)
+{
+	for (uint8_t i = 0; i < OTA_WINDOW_SIZE; i++)
+		window[i] = NULL;
+	for (uint8_t i = 0; i < OTA_WINDOW_SIZE + 1; i++)
+		free_buffs[i] = &frame_pool[i];
+	free_count = OTA_WINDOW_SIZE;
+	rx_df = free_buffs[free_count];
+	next_seq = 0;
+	num_of_retries = 0;
+}
+/**
+ * @brief Stores the data frame that was just received in its window slot. Duplicates and frames
+ * outside of the window are dropped, the status response tells the uploader what is still missing.
+ */
+static RAMFUNC void window_store_frame(void)
+{
+	uint16_t offset = rx_df->seq - next_seq;
+	uint8_t slot = rx_df->seq % OTA_WINDOW_SIZE;
+	if (offset >= OTA_WINDOW_SIZE || window[slot] != NULL)
+		return;
+	window[slot] = rx_df;
+	// there is always a free buffer since the window holds at most OTA_WINDOW_SIZE frames
+	rx_df = free_buffs[--free_count];
+}
+/**
+ * @brief Writes every frame that is next in line to flash and moves the window forward. Does nothing
+ * while the slot is still being erased.
+ *
+ * @return OTA_Status_t
+ */
+static RAMFUNC OTA_Status_t window_commit_frames(void)
+{
+	OTA_Status_t ret = session_finish_erase();
+	if (ret != OTA_OK)
+		return (ret == OTA_TIMEOUT) ? OTA_OK : OTA_ERR;
+	uint8_t slot = next_seq % OTA_WINDOW_SIZE;
+	while (window[slot] != NULL)
+	{
+		//writes firmware to flash memory while the uploader streams the
+		//next frames in
+		if (commit_data_frame(window[slot]) != OTA_OK)
+			return OTA_ERR;
+		free_buffs[free_count++] = window[slot];
+		window[slot] = NULL;
+		next_seq++;
+		num_of_retries = 0;
+		session_checkpoint();
+		slot = next_seq % OTA_WINDOW_SIZE;
+	}
+	return OTA_OK;
+}
+/**
+ * @brief Erases flash, downloads the firmware from uploader, and writes it to flash memory.
+ * Expects the UART RX ring buffer to be running.
+ *
+ * @param app_addr [ @ref APP_SLOT_ADDR ]Flash Address to write firmware to
+ * @return OTA_Status_t
+ */
+static RAMFUNC OTA_Status_t download_and_flash(uint32_t app_addr)
+{
+	window_reset();
+	slot_erasing = 0;
+	erase_ahead = 0;
+	baud_log = NULL;
+	session_app_addr = app_addr;
+	base_slot_addr = Flash_OtherSlot(app_addr);
+	//a base slot with a trailer is described by the image CRC in it, nothing else of the slot is read
+	const Image_Trailer_t *base_trailer = (const Image_Trailer_t *)(base_slot_addr + IMAGE_TRAILER_OFFSET);
+	Image_Trailer_t trailer;
+	base_crc_valid = (Image_GetTrailer(base_slot_addr, base_trailer->load_addr, &trailer) == IMAGE_OK);
+	base_slot_crc = trailer.image_crc;
+	rx_df->data_type = 0;
+	rx_parser.state = OTA_PARSE_SOF;
+	rx_parser.result = OTA_PARSE_INCOMPLETE;
 	printf("Waiting for firmware\r\n");
+	//the slot is erased during the handshake unless it holds a download that can be resumed
+	uint8_t erase_pending = !ota_resume_pending();
 	//Lets the uploader know the firmware is ready to be received
-	send_byte_response(OTA_BOOTLOADER_UPLOAD_READY);
+	send_ready_response(erase_pending ? OTA_ERASE_STATE_AHEAD : OTA_ERASE_STATE_NONE);
 	OTA_Status_t ret;
 	//Checks if the data type is start data
 	//anything else we discard
-	while(df.data_type != OTA_DATA_TYPE_START_DATA)
+	while(rx_df->data_type != OTA_DATA_TYPE_START_DATA)
 	{
-		ret = get_data_frame(&df);
+		ret = get_data_frame(rx_df, HAL_MAX_DELAY);
 		if (ret != OTA_OK)
 		{
 			printf("Error Obtaining Data Frame\r\n");
 			return OTA_ERR;
 		}
+		//the queries read both slots from flash, once the erase has started they are turned down
+		//before they get there
+		if (erase_ahead && (rx_df->data_type == OTA_DATA_TYPE_IMAGE_INFO || rx_df->data_type == OTA_DATA_TYPE_BOOT_SLOT ||
+							rx_df->data_type == OTA_DATA_TYPE_BLOCK_HASHES))
+		{
+			send_status_response(OTA_STATUS_NACK);
+			continue;
+		}
+		if (rx_df->data_type == OTA_DATA_TYPE_IMAGE_INFO)
+		{
+			send_image_info();
+			continue;
+		}
+		if (rx_df->data_type == OTA_DATA_TYPE_BLOCK_HASHES)
+		{
+			send_block_hashes();
+			continue;
+		}
+		if (rx_df->data_type == OTA_DATA_TYPE_BOOT_SLOT)
+		{
+			if (boot_slot_check(rx_df) == OTA_OK)
+			{
+				send_status_response(OTA_STATUS_ACK);
+				return OTA_NO_UPDATE;
+			}
+			send_status_response(OTA_STATUS_NACK);
+			continue;
+		}
+		//SLOT INFO and a START DATA built on the base slot need its CRC, a slot without a trailer is
+		//read before the erase starts, reading it during the erase would stall until it is done
+		if (rx_df->data_type == OTA_DATA_TYPE_SLOT_INFO ||
+			(rx_df->data_type == OTA_DATA_TYPE_START_DATA && rx_df->data_size >= 2 &&
+			 (rx_df->data[1] == OTA_IMAGE_MODE_DELTA || rx_df->data[1] == OTA_IMAGE_MODE_SYNC)))
+			base_crc_update();
+		//any other frame means an image is coming, from here until the erase is done only error
+		//messages run from flash
+		if (erase_pending)
+		{
+			erase_pending = 0;
+			printf("Erasing slot ahead of the download\r\n");
+			if (session_erase_start() != OTA_OK)
+				return OTA_ERR;
+			erase_ahead = 1;
+		}
+		if (rx_df->data_type == OTA_DATA_TYPE_SET_BAUD)
+		{
+			change_baud_rate(rx_df);
+			print_baud_log();
+		}
+		else if (rx_df->data_type == OTA_DATA_TYPE_SLOT_INFO)
+			send_slot_info();
+		else if (rx_df->data_type != OTA_DATA_TYPE_START_DATA)
+			send_status_response(OTA_STATUS_ACK);
 	}
-	//erase the flash sector to store the data
-	printf("Download starting erasing flash\r\n");
-	if(Flash_EraseSector(Flash_GetSector(app_addr), DEVICE_VOLTAGE_RANGE) != FLASH_APP_OK)
+	if (session_start(rx_df) != OTA_OK)
 	{
-		printf("Error erasing flash\r\n");
+		send_status_response(OTA_STATUS_NACK);
 		return OTA_ERR;
 	}
-	//we ack after erasing flash since there is a short delay
-	//when erasing flash and we get data loss because the uploader
-	//sends the data immediatly after receving ack
-	send_byte_response(OTA_ACK);
+	//the slot is still being erased, the frames the uploader sends meanwhile are buffered in the
+	//window and the RX ring
+	send_status_response(OTA_STATUS_ACK);
+	uint32_t start_tick = HAL_GetTick();
 	//loops through until we receive the END DATA data type
 	while (1)
 	{
-		ret = get_data_frame(&df);
+		//while the slot is erased the loop comes back every OTA_ERASE_POLL_TIME to commit what is buffered
+		ret = get_data_frame(rx_df, slot_erasing ? OTA_ERASE_POLL_TIME : HAL_MAX_DELAY);
+		if (ret == OTA_TIMEOUT)
+		{
+			uint16_t committed = next_seq;
+			if (window_commit_frames() != OTA_OK)
+			{
+				printf("Error Writing to Flash\r\n");
+				return OTA_ERR;
+			}
+			if (next_seq != committed)
+				send_status_response(OTA_STATUS_ACK);
+			continue;
+		}
 		if (ret != OTA_OK)
 		{
 			return OTA_ERR;
 		}
-		if (df.data_type == OTA_DATA_TYPE_END_DATA)
+		if (rx_df->data_type == OTA_DATA_TYPE_END_DATA)
 		{
+			//END DATA carries the number of data frames, anything else
+			//means the uploader and the bootloader are out of sync
+			if (rx_df->seq != next_seq)
+			{
+				printf("END DATA received with frames missing\r\n");
+				send_status_response(OTA_STATUS_NACK);
+				continue;
+			}
+			//an image without data frames(a sync where no block changed) can end while the slot is
+			//still being erased, the session is only set up once the erase is done
+			if (slot_erasing)
+			{
+				Flash_EraseWait();
+				if (session_finish_erase() != OTA_OK)
+				{
+					send_status_response(OTA_STATUS_NACK);
+					return OTA_ERR;
+				}
+			}
+			//every data frame has already been committed at this point, only
+			//the end of a compressed image can still be in the decoder
+			if (session_finish(start_tick) != OTA_OK)
+			{
+				printf("Error Writing to Flash\r\n");
+				send_status_response(OTA_STATUS_NACK);
+				return OTA_ERR;
+			}
+			//uploaders that don't send a trailer leave the slot to be checked as a whole
+			if (rx_df->data_size > 1 && session_write_trailer(rx_df) != OTA_OK)
+			{
+				printf("Image trailer rejected\r\n");
+				//resuming would only end with the same trailer
+				Journal_Clear();
+				send_status_response(OTA_STATUS_NACK);
+				return OTA_ERR;
+			}
+			send_status_response(OTA_STATUS_ACK);
 			break;
 		}
-		//writes firmware to flash memory
-		if (Flash_WriteData(app_addr, df.data, df.data_size) != FLASH_APP_OK)
+		if (rx_df->data_type == OTA_DATA_TYPE_SET_BAUD)
 		{
-			printf("Error Writing to Flash\r\n");
-			return OTA_ERR;
+			//the uploader only changes the rate with no data frames in flight
+			change_baud_rate(rx_df);
+			print_baud_log();
+			continue;
 		}
+		if (rx_df->data_type == OTA_DATA_TYPE_DATA ||
+			(rx_df->data_type == OTA_DATA_TYPE_DATA_AT &&
+			 (image_mode == OTA_IMAGE_MODE_RAW || image_mode == OTA_IMAGE_MODE_SYNC)))
+		{
+			window_store_frame();
+			if (window_commit_frames() != OTA_OK)
+			{
+				printf("Error Writing to Flash\r\n");
+				return OTA_ERR;
+			}
+			//frames that came in during the erase are ACKed once they are in flash, a status
+			//with nothing committed would only make the uploader resend them
+			if (slot_erasing)
+				continue;
+		}
+		//only ACKs what is in flash, also answers repeated START DATA frames
+		send_status_response(OTA_STATUS_ACK);
 	}
 	printf("Finished writing new firmware!\r\n");
 	return OTA_OK;
 }
+
+OTA_Status_t ota_download_and_flash(uint32_t app_addr)
+{
+	//checks to make sure app_addr is a valid app SLOT#
+	if(!Flash_ValidFlashAppMem(app_addr))
+	{
+		printf("Invalid Flash Address\r\n");
+		return OTA_ERR;
+	}
+	pclk1_freq = HAL_RCC_GetPCLK1Freq();
+	uart_errors = 0;
+	frame_log_count = 0;
+	//receives in the background with DMA so no bytes are lost while flash is written
+	if (RxRing_Start(&huart2) != RX_RING_OK)
+	{
+		printf("Error starting UART DMA reception\r\n");
+		return OTA_ERR;
+	}
+	OTA_Status_t ret = download_and_flash(app_addr);
+	RxRing_Stop();
+	//the image is complete or the device already has it, there is nothing left to resume
+	if (ret == OTA_OK || ret == OTA_NO_UPDATE)
+		Journal_Clear();
+	//the uploader goes back to the default rate once the session is over
+	if (huart2.Init.BaudRate != OTA_DEFAULT_BAUD)
+		uart_set_baud_rate(OTA_DEFAULT_BAUD, 1);
+	return ret;
+}
+
+uint8_t ota_resume_pending(void)
+{
+	Journal_Record_t record;
+	return Journal_GetLast(&record) == JOURNAL_OK && record.next_seq > 0;
+}
+
+void ota_resume_clear(void) { Journal_Clear(); }
+
+void ota_get_slot_crc(Flash_CRC32_t *crc) { *crc = slot_crc; }
+
+uint32_t ota_get_load_addr(void) { return load_addr; }
+
+uint32_t ota_get_image_size(void) { return write_offset; }
+
+uint32_t ota_get_boot_slot(void) { return boot_slot_addr; }
\ No newline at end of file
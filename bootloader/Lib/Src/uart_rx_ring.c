@@ -0,0 +1,148 @@
+#include "uart_rx_ring.h"
+
+#define RX_RING_MASK (RX_RING_SIZE - 1U)
+
+typedef struct
+{
+	UART_HandleTypeDef *huart;
+	uint16_t tail;				 // next index the consumer reads from
+	uint16_t last_event_pos;	 // DMA position reported by the last rx event
+	volatile uint32_t dma_total; // bytes written by the DMA up to the last rx event
+	uint32_t read_total;		 // bytes read by the consumer
+	volatile uint8_t restarted;	 // set when reception had to be restarted(error or overflow)
+	volatile uint32_t errors;
+} RxRing_t;
+
+static uint8_t rx_buff[RX_RING_SIZE];
+static RxRing_t ring = {0};
+
+/**
+ * @brief Gets the index the DMA will write the next byte to
+ *
+ * @return uint16_t
+ */
+static RAMFUNC uint16_t get_head(void)
+{
+	return (uint16_t)((RX_RING_SIZE - __HAL_DMA_GET_COUNTER(ring.huart->hdmarx)) & RX_RING_MASK);
+}
+/**
+ * @brief (Re)starts the circular DMA reception from the beginning of the buffer
+ *
+ * @return RxRing_Status_t
+ */
+static RAMFUNC RxRing_Status_t start_reception(void)
+{
+	ring.tail = 0;
+	ring.last_event_pos = 0;
+	ring.dma_total = 0;
+	ring.read_total = 0;
+	if (HAL_UARTEx_ReceiveToIdle_DMA(ring.huart, rx_buff, RX_RING_SIZE) != HAL_OK)
+		return RX_RING_ERR;
+	return RX_RING_OK;
+}
+
+RAMFUNC RxRing_Status_t RxRing_Start(UART_HandleTypeDef *huart)
+{
+	if (huart == NULL || huart->hdmarx == NULL || huart->hdmarx->Init.Mode != DMA_CIRCULAR)
+		return RX_RING_ERR;
+	ring.huart = huart;
+	ring.restarted = 0;
+	ring.errors = 0;
+	return start_reception();
+}
+
+RAMFUNC void RxRing_Stop(void)
+{
+	if (ring.huart == NULL)
+		return;
+	HAL_UART_AbortReceive(ring.huart);
+	ring.huart = NULL;
+}
+
+RAMFUNC uint16_t RxRing_Available(void)
+{
+	if (ring.huart == NULL)
+		return 0;
+	return (uint16_t)((get_head() - ring.tail) & RX_RING_MASK);
+}
+
+RAMFUNC uint16_t RxRing_ReadAvailable(uint8_t *dst, uint16_t len)
+{
+	// the overflow and error callbacks move tail and read_total when they restart the ring, a restart
+	// between reading them and writing them back would be lost
+	__disable_irq();
+	uint16_t available = RxRing_Available();
+	if (len > available)
+		len = available;
+	// copies in at most two parts since the data can wrap around the end of the buffer
+	uint16_t first_part = RX_RING_SIZE - ring.tail;
+	if (first_part > len)
+		first_part = len;
+	memcpy(dst, &rx_buff[ring.tail], first_part);
+	memcpy(dst + first_part, rx_buff, len - first_part);
+	ring.tail = (ring.tail + len) & RX_RING_MASK;
+	ring.read_total += len;
+	__enable_irq();
+	return len;
+}
+
+RAMFUNC RxRing_Status_t RxRing_WaitData(uint32_t timeout)
+{
+	uint32_t tickstart = HAL_GetTick();
+	while (RxRing_Available() == 0)
+	{
+		if (ring.restarted)
+			break;
+		if (timeout != HAL_MAX_DELAY && (HAL_GetTick() - tickstart) >= timeout)
+			return RX_RING_TIMEOUT;
+		// Woken up by SysTick, or by the DMA HT/TC and UART IDLE interrupts
+		__WFI();
+	}
+	if (ring.restarted)
+	{
+		ring.restarted = 0;
+		return RX_RING_ERR;
+	}
+	return RX_RING_OK;
+}
+
+RAMFUNC uint32_t RxRing_GetErrorCount(void) { return ring.errors; }
+
+/**
+ * @brief Called by the HAL on IDLE line, DMA half transfer and DMA transfer complete
+ *
+ * @param huart UART handle
+ * @param Size position in the buffer the DMA has reached
+ */
+RAMFUNC void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
+{
+	if (huart != ring.huart)
+		return;
+	uint16_t pos = Size & RX_RING_MASK;
+	ring.dma_total += (uint16_t)(pos - ring.last_event_pos) & RX_RING_MASK;
+	ring.last_event_pos = pos;
+	// the DMA lapped the consumer so unread data was overwritten
+	if (ring.dma_total - ring.read_total > RX_RING_SIZE)
+	{
+		ring.errors++;
+		ring.restarted = 1;
+		ring.tail = pos;
+		ring.read_total = ring.dma_total;
+	}
+}
+
+/**
+ * @brief Called by the HAL on overrun, framing, noise or DMA errors. The HAL has already
+ * aborted the reception at this point so it is restarted here.
+ *
+ * @param huart UART handle
+ */
+RAMFUNC void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+	if (huart != ring.huart)
+		return;
+	ring.errors++;
+	ring.restarted = 1;
+	if (huart->RxState == HAL_UART_STATE_READY)
+		start_reception();
+}
@@ -0,0 +1,20 @@
+/**
+ ******************************************************************************
+ * @file           : main.h
+ * @brief          : Header for the host simulator, replaces Core/Inc/main.h so
+ *                   the Lib sources build against the simulated peripherals.
+ ******************************************************************************
+ */
+
+#ifndef __MAIN_H
+#define __MAIN_H
+
+#include "stm32f4xx_hal.h"
+#include "sim_periph.h"
+
+// Host code is never fetched from the simulated flash
+#define RAMFUNC
+
+void Error_Handler(void);
+
+#endif /* __MAIN_H */
@@ -0,0 +1,115 @@
+#ifndef SIM_PERIPH_H_
+#define SIM_PERIPH_H_
+
+#include "stm32f4xx_hal.h"
+#include <stdint.h>
+
+/*
+Peripherals the Lib sources use straight through their registers are moved to memory the simulator
+owns. Flash is a file mapped at FLASH_BASE so flash addresses are the same as on the device.
+Flash, the FLASH registers and the CRC unit are mapped read only, every store to them traps, is
+single stepped and then applied by the model: programming can only clear bits and needs PG set and
+the flash unlocked, FLASH CR is only writable after the KEYR unlock sequence, SR error flags are
+cleared by writing 1 and a write to CRC DR updates the CRC. STRT with SER starts a sector erase that
+keeps BSY set for the erase time, its end is checked in __WFI() where the FLASH interrupt is taken. DWT CYCCNT follows the simulated clock
+at SIM_SYSCLK_FREQ, which leaves out the time spent trapping.
+Single stepping uses the x86-64 trap flag, so the simulator only runs on x86-64 Linux.
+*/
+
+// STM32F401RE flash size
+#define SIM_FLASH_SIZE	0x00080000U
+#define SIM_SYSCLK_FREQ 84000000U
+#define SIM_PCLK1_FREQ	42000000U
+
+// Typical programming and sector erase times of the STM32F401xE datasheet with x32 parallelism
+#define SIM_PROGRAM_TIME_US	   16U
+#define SIM_ERASE_16K_TIME_MS  250U
+#define SIM_ERASE_64K_TIME_MS  550U
+#define SIM_ERASE_128K_TIME_MS 1000U
+
+extern CRC_TypeDef *Sim_Crc;
+extern FLASH_TypeDef *Sim_Flash;
+extern RCC_TypeDef Sim_Rcc;
+extern DWT_Type *Sim_Dwt;
+extern CoreDebug_Type Sim_CoreDebug;
+
+#undef CRC
+#define CRC Sim_Crc
+#undef FLASH
+#define FLASH Sim_Flash
+#undef RCC
+#define RCC (&Sim_Rcc)
+#undef DWT
+#define DWT Sim_Dwt
+#undef CoreDebug
+#define CoreDebug (&Sim_CoreDebug)
+#undef __WFI
+#define __WFI() Sim_WaitForInterrupt()
+#define __disable_irq() Sim_DisableInterrupts()
+#define __enable_irq()	Sim_EnableInterrupts()
+
+typedef enum
+{
+	SIM_OK,
+	SIM_ERR
+} Sim_Status_t;
+
+/**
+ * @brief Maps the flash file at FLASH_BASE and sets up the trapped peripherals. A new or short file is
+ * filled up with erased flash.
+ *
+ * @param flash_file path of the file that holds the flash contents
+ * @return Sim_Status_t
+ */
+Sim_Status_t Sim_PeriphInit(const char *flash_file);
+
+/**
+ * @brief Scales every modelled flash programming and erase time
+ *
+ * @param scale 1.0 for datasheet times, 0 to leave them out
+ */
+void Sim_SetTimeScale(double scale);
+
+/**
+ * @brief Waits for a modelled amount of time, scaled by Sim_SetTimeScale()
+ *
+ * @param us time in microseconds
+ */
+void Sim_Wait(uint32_t us);
+
+/**
+ * @brief Gets the simulated time since Sim_PeriphInit(), the host time less the time spent trapping
+ * accesses to the simulated peripherals
+ *
+ * @return uint64_t time in nanoseconds
+ */
+uint64_t Sim_GetTimeNs(void);
+
+/**
+ * @brief Sleeps until Sim_RaiseInterrupt() is called or for at most one SysTick period. Returns
+ * straight away if an interrupt was raised since the last call.
+ */
+void Sim_WaitForInterrupt(void);
+
+/**
+ * @brief Wakes the main thread up from Sim_WaitForInterrupt()
+ */
+void Sim_RaiseInterrupt(void);
+
+/**
+ * @brief Holds off the UART receive thread, which plays the part of the interrupts the DMA stream and
+ * the IDLE line raise. The FLASH interrupt is only taken in __WFI() on the main thread anyway.
+ */
+void Sim_DisableInterrupts(void);
+
+/**
+ * @brief Lets the UART receive thread run again after Sim_DisableInterrupts()
+ */
+void Sim_EnableInterrupts(void);
+
+/**
+ * @brief FLASH interrupt handler, sim_main.c has it like stm32f4xx_it.c on the device
+ */
+void FLASH_IRQHandler(void);
+
+#endif // SIM_PERIPH_H_
@@ -0,0 +1,44 @@
+#ifndef SIM_UART_H_
+#define SIM_UART_H_
+
+#include "main.h"
+
+/*
+USART2 of the simulator is a pseudo terminal, firmware_upload.py opens its slave side like a serial
+port. Both directions are paced at the baud rate the bootloader has set(10 bits per byte).
+Received bytes go to the buffer of a running HAL_UARTEx_ReceiveToIdle_DMA() with the NDTR counter,
+half/full transfer and IDLE line events of a circular DMA stream, or to a small FIFO that
+HAL_UART_Receive() reads from. printf output is sent over the UART like on the device and is also
+copied to stderr. Line errors can be injected into received bytes, one bit of a byte is flipped.
+*/
+
+// Bytes received outside of DMA reception that are kept for HAL_UART_Receive()
+#define SIM_UART_FIFO_SIZE 256U
+
+/**
+ * @brief Opens the pseudo terminal, links the UART handle to the simulated USART2 and DMA stream and
+ * starts the receive thread
+ *
+ * @param huart UART handle used by the Lib sources
+ * @param hdma_rx DMA handle for reception
+ * @param link_path symlink to create to the slave side, can be NULL
+ * @return Sim_Status_t
+ */
+Sim_Status_t Sim_UartInit(UART_HandleTypeDef *huart, DMA_HandleTypeDef *hdma_rx, const char *link_path);
+
+/**
+ * @brief Gets the path of the slave side of the pseudo terminal
+ *
+ * @return const char*
+ */
+const char *Sim_UartGetPort(void);
+
+/**
+ * @brief Sets the share of received bytes that get a bit flipped. The errors come from a fixed seed
+ * so runs with the same traffic see the same errors.
+ *
+ * @param rate 0 for an error free line, 1 to break every byte
+ */
+void Sim_UartSetErrorRate(double rate);
+
+#endif // SIM_UART_H_
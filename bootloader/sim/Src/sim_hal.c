@@ -0,0 +1,75 @@
+#include "main.h"
+
+/*
+The HAL functions the Lib sources call, run against the simulated peripherals. Flash programming
+goes through a store to the flash mapping like the real driver so the model handles it the same
+way as the register level programming in flash_app_handler.c.
+*/
+
+// Error flags HAL_FLASH_Program() clears before programming and checks after
+#define FLASH_PROGRAM_ERRORS (FLASH_SR_PGSERR | FLASH_SR_PGPERR | FLASH_SR_PGAERR | FLASH_SR_WRPERR)
+
+uint32_t SystemCoreClock = SIM_SYSCLK_FREQ;
+
+uint32_t HAL_GetTick(void) { return (uint32_t)(Sim_GetTimeNs() / 1000000U); }
+
+void HAL_Delay(uint32_t Delay)
+{
+	uint32_t tickstart = HAL_GetTick();
+	while (HAL_GetTick() - tickstart < Delay)
+		Sim_WaitForInterrupt();
+}
+
+uint32_t HAL_RCC_GetPCLK1Freq(void) { return SIM_PCLK1_FREQ; }
+
+uint32_t HAL_RCC_GetSysClockFreq(void) { return SIM_SYSCLK_FREQ; }
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void)
+{
+	if (FLASH->CR & FLASH_CR_LOCK)
+	{
+		FLASH->KEYR = FLASH_KEY1;
+		FLASH->KEYR = FLASH_KEY2;
+	}
+	return (FLASH->CR & FLASH_CR_LOCK) ? HAL_ERROR : HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void)
+{
+	FLASH->CR |= FLASH_CR_LOCK;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data)
+{
+	uint32_t psize;
+	if (FLASH->CR & FLASH_CR_LOCK)
+		return HAL_ERROR;
+	switch (TypeProgram)
+	{
+	case FLASH_TYPEPROGRAM_BYTE:
+		psize = FLASH_PSIZE_BYTE;
+		break;
+	case FLASH_TYPEPROGRAM_HALFWORD:
+		psize = FLASH_PSIZE_HALF_WORD;
+		break;
+	case FLASH_TYPEPROGRAM_WORD:
+		psize = FLASH_PSIZE_WORD;
+		break;
+	default:
+		psize = FLASH_PSIZE_DOUBLE_WORD;
+		break;
+	}
+	FLASH->SR = FLASH_PROGRAM_ERRORS;
+	FLASH->CR = (FLASH->CR & CR_PSIZE_MASK) | psize | FLASH_CR_PG;
+	if (TypeProgram == FLASH_TYPEPROGRAM_BYTE)
+		*(volatile uint8_t *)(uintptr_t)Address = (uint8_t)Data;
+	else if (TypeProgram == FLASH_TYPEPROGRAM_HALFWORD)
+		*(volatile uint16_t *)(uintptr_t)Address = (uint16_t)Data;
+	else if (TypeProgram == FLASH_TYPEPROGRAM_WORD)
+		*(volatile uint32_t *)(uintptr_t)Address = (uint32_t)Data;
+	else
+		*(volatile uint64_t *)(uintptr_t)Address = Data;
+	FLASH->CR &= ~FLASH_CR_PG;
+	return (FLASH->SR & FLASH_PROGRAM_ERRORS) ? HAL_ERROR : HAL_OK;
+}
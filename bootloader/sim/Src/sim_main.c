@@ -0,0 +1,183 @@
+#include "main.h"
+#include "bl_version.h"
+#include "flash_app_handler.h"
+#include "image_trailer.h"
+#include "ota_update.h"
+#include "sim_uart.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+Host simulator of the bootloader's firmware update mode. Waits for NEW_FIRMWARE on the simulated
+UART, runs ota_download_and_flash() into the inactive slot and on success makes it the active
+one(or copies it to the main slot) and writes the config like main.c does. A session the uploader
+ends with BOOT SLOT only switches the active slot if it asked for the other one.
+*/
+
+#define NEW_FIRMWARE 0x34
+
+UART_HandleTypeDef huart2;
+DMA_HandleTypeDef hdma_usart2_rx;
+
+void Error_Handler(void)
+{
+	printf("Error_Handler\r\n");
+	exit(EXIT_FAILURE);
+}
+
+void FLASH_IRQHandler(void) { Flash_IRQHandler(); }
+/**
+ * @brief Finishes an update the way main.c does. An image that runs from the slot it was written to
+ * becomes the active one, one linked for the main slot is copied there. Its CRC goes to the config.
+ *
+ * @param app_addr slot the download was written to
+ * @return OTA_Status_t
+ */
+static OTA_Status_t finish_update(uint32_t app_addr)
+{
+	Flash_Config_t config = {0};
+	Flash_CRC32_t slot_crc;
+	ota_get_slot_crc(&slot_crc);
+	if (Flash_GetConfig(&config) != FLASH_APP_OK)
+		return OTA_ERR;
+	uint8_t crc = Flash_FoldCRC32(Flash_CRC32SlotValue(&slot_crc));
+	config.first_boot = FIRST_BOOT_FALSE;
+	if (ota_get_load_addr() == app_addr)
+	{
+		if (app_addr == MAIN_APP_SLOT_ADDR)
+			config.slot0_crc = crc;
+		else
+			config.slot1_crc = crc;
+		Flash_SetActiveSlot(&config, app_addr);
+	}
+	else
+	{
+		if (Image_Copy(BCKUP_APP_SLOT_ADDR, MAIN_APP_SLOT_ADDR, ota_get_image_size()) != IMAGE_OK)
+		{
+			printf("Error copying new firmware to main slot\r\n");
+			return OTA_ERR;
+		}
+		//same check as main.c, the trailer when there is one and the image part of the slot otherwise
+		Image_Status_t copy_status = Image_Verify(MAIN_APP_SLOT_ADDR, MAIN_APP_SLOT_ADDR, NULL);
+		if (copy_status == IMAGE_NO_TRAILER && Flash_VerifyCRC32(MAIN_APP_SLOT_ADDR, &slot_crc) == FLASH_APP_OK)
+			copy_status = IMAGE_OK;
+		if (copy_status != IMAGE_OK)
+		{
+			printf("Main slot copy corrupted\r\n");
+			return OTA_ERR;
+		}
+		config.slot0_crc = crc;
+		config.slot1_crc = crc;
+		Flash_SetActiveSlot(&config, MAIN_APP_SLOT_ADDR);
+	}
+	if (Flash_WriteConfig(config) != FLASH_APP_OK)
+		return OTA_ERR;
+	return OTA_OK;
+}
+
+/**
+ * @brief Keeps the image the uploader found on the device the way main.c does, the slot holding it
+ * becomes the active one
+ *
+ * @return OTA_Status_t
+ */
+static OTA_Status_t keep_image(void)
+{
+	Flash_Config_t config = {0};
+	uint32_t keep_addr = ota_get_boot_slot();
+	if (Flash_GetConfig(&config) != FLASH_APP_OK)
+		return OTA_ERR;
+	printf("Firmware is already on the device\r\n");
+	if (keep_addr == Flash_ActiveSlot(&config) && config.first_boot != FIRST_BOOT_TRUE)
+		return OTA_OK;
+	config.first_boot = FIRST_BOOT_FALSE;
+	//an image without a trailer is checked against the 8-bit CRC of its slot at the next boot
+	Image_Trailer_t trailer;
+	uint8_t crc = 0;
+	if (Image_GetTrailer(keep_addr, keep_addr, &trailer) != IMAGE_OK)
+	{
+		if (Flash_CalculateCRC(keep_addr, &crc) != FLASH_APP_OK)
+			return OTA_ERR;
+		if (keep_addr == MAIN_APP_SLOT_ADDR)
+			config.slot0_crc = crc;
+		else
+			config.slot1_crc = crc;
+	}
+	Flash_SetActiveSlot(&config, keep_addr);
+	return (Flash_WriteConfig(config) == FLASH_APP_OK) ? OTA_OK : OTA_ERR;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"Usage: %s [-f flash_file] [-l link] [-t time_scale] [-e error_rate] [-n sessions]\n"
+			"  -f file holding the 512K flash, created erased if missing (default: sim_flash.bin)\n"
+			"  -l symlink to create to the simulated serial port\n"
+			"  -t scale of the flash programming and erase times, 0 leaves them out (default: 1)\n"
+			"  -e share of received bytes that get a bit flipped (default: 0)\n"
+			"  -n exit after this many update sessions, the exit code is the result of the last one\n",
+			name);
+}
+
+int main(int argc, char **argv)
+{
+	const char *flash_file = "sim_flash.bin";
+	const char *link_path = NULL;
+	long sessions = -1;
+	OTA_Status_t ret = OTA_OK;
+	int opt;
+	while ((opt = getopt(argc, argv, "f:l:t:e:n:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'f':
+			flash_file = optarg;
+			break;
+		case 'l':
+			link_path = optarg;
+			break;
+		case 't':
+			Sim_SetTimeScale(atof(optarg));
+			break;
+		case 'e':
+			Sim_UartSetErrorRate(atof(optarg));
+			break;
+		case 'n':
+			sessions = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (Sim_PeriphInit(flash_file) != SIM_OK || Sim_UartInit(&huart2, &hdma_usart2_rx, link_path) != SIM_OK)
+	{
+		fprintf(stderr, "Failed to start the simulator\n");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "Simulated UART: %s\n", (link_path != NULL) ? link_path : Sim_UartGetPort());
+	printf("Starting Bootloader v%d.%d Simulator\r\n", VERSION_MAJOR, VERSION_MINOR);
+	while (sessions != 0)
+	{
+		uint8_t rcv_buff = 0;
+		printf("Listening for UART Commands\r\n");
+		if (HAL_UART_Receive(&huart2, &rcv_buff, 1, HAL_MAX_DELAY) != HAL_OK || rcv_buff != NEW_FIRMWARE)
+			continue;
+		printf("Starting firmware download\r\n");
+		//the update goes to the inactive slot like on the board
+		Flash_Config_t config = {0};
+		Flash_GetConfig(&config);
+		uint32_t app_addr = Flash_OtherSlot(Flash_ActiveSlot(&config));
+		printf("Writing to slot 0x%08lX\r\n", (unsigned long)app_addr);
+		ret = ota_download_and_flash(app_addr);
+		if (ret == OTA_OK)
+			ret = finish_update(app_addr);
+		else if (ret == OTA_NO_UPDATE)
+			ret = keep_image();
+		printf((ret == OTA_OK) ? "Firmware update is completed!\r\n" : "OTA Update: ERROR!!\r\n");
+		if (sessions > 0)
+			sessions--;
+	}
+	return (ret == OTA_OK) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,439 @@
+#define _GNU_SOURCE
+#include "main.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#if !defined(__x86_64__) || !defined(__linux__)
+#error "The simulator single steps trapped stores with the x86-64 trap flag"
+#endif
+
+#define TRAP_FLAG		 0x100
+#define SIM_PAGE_SIZE	 4096U
+// widest store the CPU can trap on
+#define MAX_STORE_SIZE	 8U
+// how long __WFI() sleeps when nothing happens, one SysTick period
+#define SYSTICK_TIME_NS	 1000000L
+// trapped stores timed at start up to find the cost of a trap the handlers can't see
+#define CALIBRATION_STORES 1000U
+
+typedef struct
+{
+	uintptr_t base;
+	size_t size;
+	int idle_prot;					  // protection between accesses
+	void (*before)(uintptr_t addr); // called before the trapped access
+	void (*after)(uintptr_t addr);	  // called once the access is done
+} Trap_Region_t;
+
+// Start addresses of the STM32F401RE flash sectors, the last entry is the end of flash
+static const uint32_t sector_addr[] = {0x08000000U, 0x08004000U, 0x08008000U, 0x0800C000U, 0x08010000U,
+									   0x08020000U, 0x08040000U, 0x08060000U, 0x08080000U};
+
+CRC_TypeDef *Sim_Crc = NULL;
+FLASH_TypeDef *Sim_Flash = NULL;
+RCC_TypeDef Sim_Rcc = {0};
+DWT_Type *Sim_Dwt = NULL;
+CoreDebug_Type Sim_CoreDebug = {0};
+
+static double time_scale = 1.0;
+static struct timespec start_time;
+static uint32_t crc_table[256];
+static uint32_t crc_value = 0xFFFFFFFFU;
+static Trap_Region_t regions[5];
+static uint8_t num_of_regions = 0;
+// access being single stepped
+static const Trap_Region_t *pending_region = NULL;
+static uintptr_t pending_addr = 0;
+static uint8_t pending_old[MAX_STORE_SIZE];
+// modelled time the pending access takes, waited once the region is trapped again
+static uint32_t pending_wait_us = 0;
+// host time the trap handlers took, left out of the simulated clock
+static uint64_t trap_start_ns = 0;
+static uint64_t trap_overhead_ns = 0;
+// signal delivery and return of one trap, taken off on top of what the handlers measure
+static uint64_t trap_entry_ns = 0;
+static FLASH_TypeDef flash_regs_old;
+// number of KEYR unlock keys written in the right order
+static uint8_t flash_keys = 0;
+// simulated time the running sector erase is done at, 0 while none is running
+static uint64_t erase_done_ns = 0;
+// wakes __WFI() up
+static pthread_mutex_t irq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t irq_cond = PTHREAD_COND_INITIALIZER;
+static uint32_t irq_count = 0;
+static uint32_t irq_seen = 0;
+
+/**
+ * @brief Gets the host time since Sim_PeriphInit()
+ *
+ * @return uint64_t time in nanoseconds
+ */
+static uint64_t host_time_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)(now.tv_sec - start_time.tv_sec) * 1000000000U + now.tv_nsec - start_time.tv_nsec;
+}
+/**
+ * @brief Finds the trapped region an address is in
+ *
+ * @param addr address
+ * @return const Trap_Region_t* NULL if the address is not trapped
+ */
+static const Trap_Region_t *find_region(uintptr_t addr)
+{
+	for (uint8_t i = 0; i < num_of_regions; i++)
+	{
+		if (addr >= regions[i].base && addr < regions[i].base + regions[i].size)
+			return &regions[i];
+	}
+	return NULL;
+}
+/**
+ * @brief Lets the faulting access through and single steps it. Anything outside of a trapped region
+ * is a real crash and gets the default action.
+ */
+static void segv_handler(int sig, siginfo_t *info, void *context)
+{
+	ucontext_t *uc = (ucontext_t *)context;
+	uintptr_t addr = (uintptr_t)info->si_addr;
+	const Trap_Region_t *region = find_region(addr);
+	if (region == NULL || pending_region != NULL)
+	{
+		signal(sig, SIG_DFL);
+		return;
+	}
+	trap_start_ns = host_time_ns();
+	pending_region = region;
+	pending_addr = addr;
+	mprotect((void *)region->base, region->size, PROT_READ | PROT_WRITE);
+	if (region->before != NULL)
+		region->before(addr);
+	uc->uc_mcontext.gregs[REG_EFL] |= TRAP_FLAG;
+}
+/**
+ * @brief Runs after the single stepped access, applies it to the model and traps the region again.
+ * The time spent trapping is taken off the simulated clock, the modelled time of the access is
+ * waited instead.
+ */
+static void trap_handler(int sig, siginfo_t *info, void *context)
+{
+	(void)info;
+	ucontext_t *uc = (ucontext_t *)context;
+	const Trap_Region_t *region = pending_region;
+	if (region == NULL)
+	{
+		signal(sig, SIG_DFL);
+		return;
+	}
+	pending_region = NULL;
+	if (region->after != NULL)
+		region->after(pending_addr);
+	mprotect((void *)region->base, region->size, region->idle_prot);
+	uc->uc_mcontext.gregs[REG_EFL] &= ~TRAP_FLAG;
+	__atomic_add_fetch(&trap_overhead_ns, host_time_ns() - trap_start_ns + trap_entry_ns, __ATOMIC_RELAXED);
+	if (pending_wait_us > 0)
+	{
+		Sim_Wait(pending_wait_us);
+		pending_wait_us = 0;
+	}
+}
+/**
+ * @brief Number of bytes a store at addr can have changed
+ *
+ * @param addr flash address
+ * @return size_t
+ */
+static size_t store_size(uintptr_t addr)
+{
+	size_t size = FLASH_BASE + SIM_FLASH_SIZE - addr;
+	return (size > MAX_STORE_SIZE) ? MAX_STORE_SIZE : size;
+}
+static void flash_before(uintptr_t addr) { memcpy(pending_old, (const void *)addr, store_size(addr)); }
+/**
+ * @brief Applies a store to flash. Programming can only clear bits and needs PG set and the flash
+ * unlocked, otherwise the old contents stay and PGSERR is set.
+ */
+static void flash_after(uintptr_t addr)
+{
+	uint8_t *mem = (uint8_t *)addr;
+	size_t size = store_size(addr);
+	if (!(Sim_Flash->CR & FLASH_CR_PG) || (Sim_Flash->CR & FLASH_CR_LOCK))
+	{
+		memcpy(mem, pending_old, size);
+		// the FLASH registers are still read only here
+		mprotect(Sim_Flash, SIM_PAGE_SIZE, PROT_READ | PROT_WRITE);
+		Sim_Flash->SR |= FLASH_SR_PGSERR;
+		mprotect(Sim_Flash, SIM_PAGE_SIZE, PROT_READ);
+		return;
+	}
+	for (size_t i = 0; i < size; i++)
+		mem[i] &= pending_old[i];
+	pending_wait_us = SIM_PROGRAM_TIME_US;
+}
+/**
+ * @brief Starts the sector erase STRT asks for. The sector reads erased straight away(on the device
+ * reading it stalls until the erase is done), BSY stays set for the modelled erase time.
+ */
+static void flash_erase_start(void)
+{
+	uint32_t sector = (Sim_Flash->CR & FLASH_CR_SNB) >> FLASH_CR_SNB_Pos;
+	Sim_Flash->CR &= ~FLASH_CR_STRT;
+	if (!(Sim_Flash->CR & FLASH_CR_SER) || (Sim_Flash->SR & FLASH_SR_BSY) ||
+		sector + 1 >= sizeof(sector_addr) / sizeof(sector_addr[0]))
+	{
+		Sim_Flash->SR |= FLASH_SR_PGSERR;
+		return;
+	}
+	uint32_t size = sector_addr[sector + 1] - sector_addr[sector];
+	uint32_t erase_ms = SIM_ERASE_128K_TIME_MS;
+	if (size <= 0x4000U)
+		erase_ms = SIM_ERASE_16K_TIME_MS;
+	else if (size <= 0x10000U)
+		erase_ms = SIM_ERASE_64K_TIME_MS;
+	mprotect((void *)FLASH_BASE, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE);
+	memset((void *)(uintptr_t)sector_addr[sector], 0xFF, size);
+	mprotect((void *)FLASH_BASE, SIM_FLASH_SIZE, PROT_READ);
+	Sim_Flash->SR |= FLASH_SR_BSY;
+	erase_done_ns = Sim_GetTimeNs() + (uint64_t)(erase_ms * 1000000.0 * time_scale);
+}
+/**
+ * @brief Ends the running sector erase once its time is up: BSY is cleared, EOP is set and the FLASH
+ * interrupt is taken if they are enabled. Runs on the main thread from __WFI(), where the interrupt
+ * would wake the CPU up.
+ */
+static void flash_erase_poll(void)
+{
+	if (erase_done_ns == 0 || Sim_GetTimeNs() < erase_done_ns)
+		return;
+	erase_done_ns = 0;
+	mprotect(Sim_Flash, SIM_PAGE_SIZE, PROT_READ | PROT_WRITE);
+	Sim_Flash->SR &= ~FLASH_SR_BSY;
+	if (Sim_Flash->CR & FLASH_CR_EOPIE)
+		Sim_Flash->SR |= FLASH_SR_EOP;
+	mprotect(Sim_Flash, SIM_PAGE_SIZE, PROT_READ);
+	if (Sim_Flash->SR & FLASH_SR_EOP)
+		FLASH_IRQHandler();
+}
+static void flash_regs_before(uintptr_t addr)
+{
+	(void)addr;
+	flash_regs_old = *Sim_Flash;
+}
+/**
+ * @brief Applies a write to the FLASH registers. SR flags are cleared by writing 1, CR ignores writes
+ * while it is locked, STRT in CR starts a sector erase and KEY1 followed by KEY2 in KEYR unlocks it.
+ */
+static void flash_regs_after(uintptr_t addr)
+{
+	if (addr == (uintptr_t)&Sim_Flash->SR)
+		Sim_Flash->SR = flash_regs_old.SR & ~Sim_Flash->SR;
+	else if (addr == (uintptr_t)&Sim_Flash->CR && (flash_regs_old.CR & FLASH_CR_LOCK))
+		Sim_Flash->CR = flash_regs_old.CR;
+	else if (addr == (uintptr_t)&Sim_Flash->CR && (Sim_Flash->CR & FLASH_CR_STRT))
+		flash_erase_start();
+	else if (addr == (uintptr_t)&Sim_Flash->KEYR)
+	{
+		if (Sim_Flash->KEYR == FLASH_KEY1)
+			flash_keys = 1;
+		else if (Sim_Flash->KEYR == FLASH_KEY2 && flash_keys == 1)
+			Sim_Flash->CR &= ~FLASH_CR_LOCK;
+		else
+			flash_keys = 0;
+		// KEYR reads as 0
+		Sim_Flash->KEYR = 0;
+	}
+}
+/**
+ * @brief CRC-32/MPEG-2 of one word, MSB first like the CRC unit
+ */
+static uint32_t crc_word(uint32_t crc, uint32_t word)
+{
+	for (int8_t shift = 24; shift >= 0; shift -= 8)
+		crc = (crc << 8) ^ crc_table[((crc >> 24) ^ (word >> shift)) & 0xFFU];
+	return crc;
+}
+/**
+ * @brief Applies a write to the CRC unit, DR always reads back the current CRC
+ */
+static void crc_after(uintptr_t addr)
+{
+	if (addr == (uintptr_t)&Sim_Crc->DR)
+		crc_value = crc_word(crc_value, Sim_Crc->DR);
+	else if (addr == (uintptr_t)&Sim_Crc->CR && (Sim_Crc->CR & CRC_CR_RESET))
+	{
+		crc_value = 0xFFFFFFFFU;
+		Sim_Crc->CR &= ~CRC_CR_RESET;
+	}
+	Sim_Crc->DR = crc_value;
+}
+static void dwt_before(uintptr_t addr)
+{
+	(void)addr;
+	Sim_Dwt->CYCCNT = (uint32_t)(Sim_GetTimeNs() * (SIM_SYSCLK_FREQ / 1000000U) / 1000U);
+}
+/**
+ * @brief Adds a trapped region
+ *
+ * @return Sim_Status_t
+ */
+static Sim_Status_t add_region(uintptr_t base, size_t size, int idle_prot, void (*before)(uintptr_t),
+							   void (*after)(uintptr_t))
+{
+	if (num_of_regions >= sizeof(regions) / sizeof(regions[0]))
+		return SIM_ERR;
+	regions[num_of_regions++] = (Trap_Region_t){base, size, idle_prot, before, after};
+	return (mprotect((void *)base, size, idle_prot) == 0) ? SIM_OK : SIM_ERR;
+}
+/**
+ * @brief Maps the flash file at FLASH_BASE
+ *
+ * @param flash_file path of the flash file
+ * @return Sim_Status_t
+ */
+static Sim_Status_t map_flash(const char *flash_file)
+{
+	int fd = open(flash_file, O_RDWR | O_CREAT, 0644);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0 || ftruncate(fd, SIM_FLASH_SIZE) != 0)
+	{
+		perror(flash_file);
+		return SIM_ERR;
+	}
+	void *flash = mmap((void *)FLASH_BASE, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE,
+					   fd, 0);
+	close(fd);
+	if (flash != (void *)FLASH_BASE)
+	{
+		fprintf(stderr, "Can't map flash at 0x%08lx\n", (unsigned long)FLASH_BASE);
+		return SIM_ERR;
+	}
+	// the part of the file that was just added reads as erased flash
+	if (st.st_size < SIM_FLASH_SIZE)
+		memset((uint8_t *)flash + st.st_size, 0xFF, SIM_FLASH_SIZE - st.st_size);
+	return SIM_OK;
+}
+
+/**
+ * @brief Times trapped stores to a scratch page to find out how long entering and leaving the
+ * signal handlers takes
+ *
+ * @return Sim_Status_t
+ */
+static Sim_Status_t calibrate_traps(void)
+{
+	volatile uint32_t *scratch = mmap(NULL, SIM_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (scratch == MAP_FAILED || add_region((uintptr_t)scratch, SIM_PAGE_SIZE, PROT_READ, NULL, NULL) != SIM_OK)
+		return SIM_ERR;
+	uint64_t start = host_time_ns();
+	for (uint32_t i = 0; i < CALIBRATION_STORES; i++)
+		*scratch = i;
+	uint64_t total = host_time_ns() - start;
+	if (total > trap_overhead_ns)
+		trap_entry_ns = (total - trap_overhead_ns) / CALIBRATION_STORES;
+	trap_overhead_ns = 0;
+	// the scratch page is the last region, it is not needed anymore
+	num_of_regions--;
+	munmap((void *)scratch, SIM_PAGE_SIZE);
+	return SIM_OK;
+}
+
+Sim_Status_t Sim_PeriphInit(const char *flash_file)
+{
+	struct sigaction sa = {0};
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	for (uint32_t n = 0; n < 256; n++)
+	{
+		uint32_t c = n << 24;
+		for (uint8_t i = 0; i < 8; i++)
+			c = (c & 0x80000000U) ? (c << 1) ^ 0x04C11DB7U : (c << 1);
+		crc_table[n] = c;
+	}
+	if (map_flash(flash_file) != SIM_OK)
+		return SIM_ERR;
+	Sim_Crc = mmap(NULL, SIM_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	Sim_Flash = mmap(NULL, SIM_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	Sim_Dwt = mmap(NULL, SIM_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (Sim_Crc == MAP_FAILED || Sim_Flash == MAP_FAILED || Sim_Dwt == MAP_FAILED)
+		return SIM_ERR;
+	Sim_Crc->DR = crc_value;
+	Sim_Flash->CR = FLASH_CR_LOCK;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_sigaction = segv_handler;
+	sigaction(SIGSEGV, &sa, NULL);
+	sa.sa_sigaction = trap_handler;
+	sigaction(SIGTRAP, &sa, NULL);
+	if (add_region(FLASH_BASE, SIM_FLASH_SIZE, PROT_READ, flash_before, flash_after) != SIM_OK ||
+		add_region((uintptr_t)Sim_Flash, SIM_PAGE_SIZE, PROT_READ, flash_regs_before, flash_regs_after) != SIM_OK ||
+		add_region((uintptr_t)Sim_Crc, SIM_PAGE_SIZE, PROT_READ, NULL, crc_after) != SIM_OK ||
+		add_region((uintptr_t)Sim_Dwt, SIM_PAGE_SIZE, PROT_NONE, dwt_before, NULL) != SIM_OK)
+		return SIM_ERR;
+	return calibrate_traps();
+}
+
+void Sim_SetTimeScale(double scale) { time_scale = scale; }
+
+void Sim_Wait(uint32_t us)
+{
+	uint64_t ns = (uint64_t)(us * 1000.0 * time_scale);
+	if (ns == 0)
+		return;
+	// sleeping is far too coarse for programming times, those are busy waited
+	if (ns >= SYSTICK_TIME_NS)
+	{
+		struct timespec ts = {(time_t)(ns / 1000000000U), (long)(ns % 1000000000U)};
+		nanosleep(&ts, NULL);
+		return;
+	}
+	uint64_t end = Sim_GetTimeNs() + ns;
+	while (Sim_GetTimeNs() < end)
+		;
+}
+
+uint64_t Sim_GetTimeNs(void)
+{
+	static uint64_t last_time_ns = 0;
+	uint64_t now = host_time_ns() - __atomic_load_n(&trap_overhead_ns, __ATOMIC_RELAXED);
+	uint64_t last = __atomic_load_n(&last_time_ns, __ATOMIC_RELAXED);
+	// the trap cost is an estimate, the clock stands still rather than going back when it is off
+	while (now > last && !__atomic_compare_exchange_n(&last_time_ns, &last, now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	return (now > last) ? now : last;
+}
+
+void Sim_WaitForInterrupt(void)
+{
+	struct timespec ts;
+	pthread_mutex_lock(&irq_lock);
+	if (irq_count == irq_seen)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += SYSTICK_TIME_NS;
+		if (ts.tv_nsec >= 1000000000L)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&irq_cond, &irq_lock, &ts);
+	}
+	irq_seen = irq_count;
+	pthread_mutex_unlock(&irq_lock);
+	flash_erase_poll();
+}
+
+void Sim_RaiseInterrupt(void)
+{
+	pthread_mutex_lock(&irq_lock);
+	irq_count++;
+	pthread_cond_broadcast(&irq_cond);
+	pthread_mutex_unlock(&irq_lock);
+}
@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+#include "sim_uart.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// termios.h has an output flag called CR1, the USART register is meant here
+#undef CR1
+
+// start, 8 data and stop bit
+#define BITS_PER_BYTE 10U
+// the line is only slept on once it is this far behind
+#define MIN_SLEEP_NS  1000000U
+
+typedef struct
+{
+	uint64_t free_at; // time the last byte is done on the line
+} Sim_Line_t;
+
+static int master_fd = -1;
+static int slave_fd = -1;
+static char slave_path[128];
+static UART_HandleTypeDef *uart = NULL;
+static USART_TypeDef usart2_regs = {0};
+static DMA_Stream_TypeDef dma_rx_regs = {0};
+static Sim_Line_t tx_line = {0};
+static Sim_Line_t rx_line = {0};
+// DMA reception, the buffer is written at dma_size - NDTR
+static pthread_mutex_t rx_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rx_cond = PTHREAD_COND_INITIALIZER;
+static uint8_t *dma_buff = NULL;
+static uint16_t dma_size = 0;
+static uint8_t fifo[SIM_UART_FIFO_SIZE];
+static uint16_t fifo_head = 0;
+static uint16_t fifo_count = 0;
+// injected line errors, a byte is broken when the next random number is below error_threshold
+static uint32_t error_threshold = 0;
+static uint32_t rng_state = 0x2545F491U;
+
+/**
+ * @brief Takes size bytes worth of time on a line at the current baud rate, sleeps once the line is
+ * far enough behind
+ *
+ * @param line TX or RX line
+ * @param size number of bytes
+ */
+static void line_transfer(Sim_Line_t *line, uint32_t size)
+{
+	uint64_t now = Sim_GetTimeNs();
+	if (line->free_at < now)
+		line->free_at = now;
+	line->free_at += (uint64_t)size * BITS_PER_BYTE * 1000000000U / uart->Init.BaudRate;
+	if (line->free_at - now >= MIN_SLEEP_NS)
+	{
+		uint64_t ns = line->free_at - now;
+		struct timespec ts = {(time_t)(ns / 1000000000U), (long)(ns % 1000000000U)};
+		nanosleep(&ts, NULL);
+	}
+}
+/**
+ * @brief xorshift32, good enough to spread errors over the received bytes
+ */
+static uint32_t next_random(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+/**
+ * @brief Flips one bit in the bytes the injected error rate picks
+ *
+ * @param data received bytes
+ * @param size number of bytes
+ */
+static void inject_errors(uint8_t *data, ssize_t size)
+{
+	for (ssize_t i = 0; i < size && error_threshold > 0; i++)
+	{
+		if (next_random() < error_threshold)
+			data[i] ^= (uint8_t)(1U << (next_random() % 8U));
+	}
+}
+/**
+ * @brief Hands received bytes to the DMA stream like the circular DMA would, with the half transfer
+ * and transfer complete events. Has to be called with rx_lock held.
+ *
+ * @param data received bytes
+ * @param size number of bytes
+ */
+static void dma_receive(const uint8_t *data, uint16_t size)
+{
+	for (uint16_t i = 0; i < size; i++)
+	{
+		dma_buff[dma_size - dma_rx_regs.NDTR] = data[i];
+		// the byte has to be in the buffer before the counter shows it
+		__atomic_store_n(&dma_rx_regs.NDTR, dma_rx_regs.NDTR - 1U, __ATOMIC_RELEASE);
+		if (dma_rx_regs.NDTR == dma_size / 2U)
+			HAL_UARTEx_RxEventCallback(uart, dma_size / 2U);
+		else if (dma_rx_regs.NDTR == 0)
+		{
+			__atomic_store_n(&dma_rx_regs.NDTR, dma_size, __ATOMIC_RELEASE);
+			HAL_UARTEx_RxEventCallback(uart, dma_size);
+		}
+	}
+}
+void Sim_DisableInterrupts(void) { pthread_mutex_lock(&rx_lock); }
+
+void Sim_EnableInterrupts(void) { pthread_mutex_unlock(&rx_lock); }
+/**
+ * @brief Receive thread, plays the part of the UART RX line and the DMA stream
+ */
+static void *rx_thread(void *arg)
+{
+	(void)arg;
+	uint8_t data[64];
+	struct pollfd pfd = {master_fd, POLLIN, 0};
+	while (1)
+	{
+		if (poll(&pfd, 1, -1) <= 0)
+			continue;
+		ssize_t size = read(master_fd, data, sizeof(data));
+		if (size <= 0)
+			continue;
+		line_transfer(&rx_line, (uint32_t)size);
+		inject_errors(data, size);
+		pthread_mutex_lock(&rx_lock);
+		if (dma_buff != NULL)
+		{
+			dma_receive(data, (uint16_t)size);
+			// IDLE line once nothing else is waiting, HAL leaves it out right after a wrap
+			if (poll(&pfd, 1, 0) == 0 && dma_rx_regs.NDTR != dma_size)
+				HAL_UARTEx_RxEventCallback(uart, dma_size - dma_rx_regs.NDTR);
+		}
+		else
+		{
+			for (ssize_t i = 0; i < size && fifo_count < SIM_UART_FIFO_SIZE; i++, fifo_count++)
+				fifo[(fifo_head + fifo_count) % SIM_UART_FIFO_SIZE] = data[i];
+			pthread_cond_broadcast(&rx_cond);
+		}
+		pthread_mutex_unlock(&rx_lock);
+		Sim_RaiseInterrupt();
+	}
+	return NULL;
+}
+/**
+ * @brief fopencookie() write function, sends printf output over the UART and copies it to stderr
+ */
+static ssize_t stdout_write(void *cookie, const char *buf, size_t size)
+{
+	(void)cookie;
+	fwrite(buf, 1, size, stderr);
+	for (size_t sent = 0; sent < size; sent += UINT16_MAX)
+	{
+		size_t part = size - sent;
+		HAL_UART_Transmit(uart, (const uint8_t *)buf + sent, (part > UINT16_MAX) ? UINT16_MAX : (uint16_t)part,
+						  HAL_MAX_DELAY);
+	}
+	return (ssize_t)size;
+}
+
+Sim_Status_t Sim_UartInit(UART_HandleTypeDef *huart, DMA_HandleTypeDef *hdma_rx, const char *link_path)
+{
+	struct termios tio;
+	pthread_t thread;
+	cookie_io_functions_t stdout_funcs = {.write = stdout_write};
+	master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master_fd < 0 || grantpt(master_fd) != 0 || unlockpt(master_fd) != 0 ||
+		ptsname_r(master_fd, slave_path, sizeof(slave_path)) != 0)
+		return SIM_ERR;
+	// the slave side is kept open so the master never sees a hang up while no uploader is connected
+	slave_fd = open(slave_path, O_RDWR | O_NOCTTY);
+	if (slave_fd < 0 || tcgetattr(slave_fd, &tio) != 0)
+		return SIM_ERR;
+	cfmakeraw(&tio);
+	tcsetattr(slave_fd, TCSANOW, &tio);
+	// like a real UART bytes are lost when nobody is listening instead of blocking the bootloader
+	fcntl(master_fd, F_SETFL, fcntl(master_fd, F_GETFL) | O_NONBLOCK);
+	if (link_path != NULL)
+	{
+		unlink(link_path);
+		if (symlink(slave_path, link_path) != 0)
+		{
+			perror(link_path);
+			return SIM_ERR;
+		}
+	}
+	uart = huart;
+	// TX is done as soon as HAL_UART_Transmit() returns
+	usart2_regs.SR = USART_SR_TC | USART_SR_TXE;
+	usart2_regs.CR1 = USART_CR1_UE | USART_CR1_TE | USART_CR1_RE;
+	huart->Instance = &usart2_regs;
+	huart->Init.BaudRate = 115200;
+	huart->Init.WordLength = UART_WORDLENGTH_8B;
+	huart->Init.StopBits = UART_STOPBITS_1;
+	huart->Init.Parity = UART_PARITY_NONE;
+	huart->Init.Mode = UART_MODE_TX_RX;
+	huart->Init.HwFlowCtl = UART_HWCONTROL_NONE;
+	huart->Init.OverSampling = UART_OVERSAMPLING_16;
+	huart->gState = HAL_UART_STATE_READY;
+	huart->RxState = HAL_UART_STATE_READY;
+	huart->hdmarx = hdma_rx;
+	hdma_rx->Instance = &dma_rx_regs;
+	hdma_rx->Init.Mode = DMA_CIRCULAR;
+	hdma_rx->Parent = huart;
+	stdout = fopencookie(NULL, "w", stdout_funcs);
+	if (stdout == NULL)
+		return SIM_ERR;
+	setvbuf(stdout, NULL, _IONBF, 0);
+	if (pthread_create(&thread, NULL, rx_thread, NULL) != 0)
+		return SIM_ERR;
+	return SIM_OK;
+}
+
+const char *Sim_UartGetPort(void) { return slave_path; }
+
+void Sim_UartSetErrorRate(double rate)
+{
+	if (rate <= 0)
+		error_threshold = 0;
+	else if (rate >= 1)
+		error_threshold = UINT32_MAX;
+	else
+		error_threshold = (uint32_t)(rate * UINT32_MAX);
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+	(void)Timeout;
+	if (huart != uart || pData == NULL)
+		return HAL_ERROR;
+	line_transfer(&tx_line, Size);
+	while (Size > 0)
+	{
+		ssize_t sent = write(master_fd, pData, Size);
+		if (sent <= 0)
+			break;
+		pData += sent;
+		Size -= (uint16_t)sent;
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+	struct timespec deadline;
+	HAL_StatusTypeDef ret = HAL_OK;
+	if (huart != uart || pData == NULL)
+		return HAL_ERROR;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += Timeout / 1000U;
+	deadline.tv_nsec += (long)(Timeout % 1000U) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock(&rx_lock);
+	for (uint16_t i = 0; i < Size && ret == HAL_OK; i++)
+	{
+		while (fifo_count == 0 && ret == HAL_OK)
+		{
+			if (Timeout == HAL_MAX_DELAY)
+				pthread_cond_wait(&rx_cond, &rx_lock);
+			else if (pthread_cond_timedwait(&rx_cond, &rx_lock, &deadline) == ETIMEDOUT)
+				ret = HAL_TIMEOUT;
+		}
+		if (ret != HAL_OK)
+			break;
+		pData[i] = fifo[fifo_head];
+		fifo_head = (fifo_head + 1U) % SIM_UART_FIFO_SIZE;
+		fifo_count--;
+	}
+	pthread_mutex_unlock(&rx_lock);
+	return ret;
+}
+
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+	if (huart != uart || pData == NULL || Size == 0)
+		return HAL_ERROR;
+	pthread_mutex_lock(&rx_lock);
+	// like on the device, what was received before the DMA started is gone
+	fifo_count = 0;
+	dma_buff = pData;
+	dma_size = Size;
+	dma_rx_regs.NDTR = Size;
+	huart->RxState = HAL_UART_STATE_BUSY_RX;
+	huart->ReceptionType = HAL_UART_RECEPTION_TOIDLE;
+	pthread_mutex_unlock(&rx_lock);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *huart)
+{
+	if (huart != uart)
+		return HAL_ERROR;
+	pthread_mutex_lock(&rx_lock);
+	dma_buff = NULL;
+	huart->RxState = HAL_UART_STATE_READY;
+	pthread_mutex_unlock(&rx_lock);
+	return HAL_OK;
+}
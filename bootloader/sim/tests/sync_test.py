@@ -0,0 +1,97 @@
+import importlib.util
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+#Runs firmware_upload.py against the host simulator for an incremental sync where no block changed:
+#the image is sent in full, then again with only a new version in its trailer, so the sync carries
+#no data frames and END DATA comes in while the slot is still being erased
+#usage: sync_test.py path/to/bootloader_sim
+
+SCRIPT_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', '..', '..', 'python_firmware_upload_script')
+UPLOADER = os.path.join(SCRIPT_DIR, 'firmware_upload.py')
+sys.path.insert(0, SCRIPT_DIR)
+from pack_image import make_trailer, pad_to_word, parse_version
+
+#exit code ctest reports as skipped
+SKIP = 77
+SIM_START_TIMEOUT = 5
+RUN_TIMEOUT = 120
+IMAGE_SIZE = 30000
+APP_SLOT_SIZE = 0x20000
+MAIN_SLOT_OFFSET = 0x20000
+
+def pack(image, version):
+	return pad_to_word(image) + make_trailer(image, parse_version(version))
+#slot holding a packed image, the trailer at the end and erased in between
+def slot_of(packed):
+	return packed[:-32] + b'\xff' * (APP_SLOT_SIZE - len(packed)) + packed[-32:]
+def upload(link, image_file, extra_args):
+	result = subprocess.run([sys.executable, UPLOADER, '-p', link, '-f', image_file, '-b', '921600'] + extra_args,
+		input='q\n', capture_output=True, text=True, timeout=RUN_TIMEOUT)
+	return result.stdout.replace('\r', '')
+#waits for the simulator to be done with a session, the uploader is done before the image is copied
+def wait_session_end(sim_log, sessions):
+	deadline = time.time() + RUN_TIMEOUT
+	while time.time() < deadline:
+		sim_log.seek(0)
+		if len(re.findall(r'^(?:Firmware update is completed!|OTA Update: ERROR!!)', sim_log.read(), re.M)) >= sessions:
+			return
+		time.sleep(0.05)
+
+def main():
+	if len(sys.argv) != 2:
+		print('usage: sync_test.py path/to/bootloader_sim')
+		return 1
+	if importlib.util.find_spec('serial') == None:
+		print('pyserial is not installed, skipping')
+		return SKIP
+	image = bytes(random.Random(IMAGE_SIZE).getrandbits(8) for _ in range(IMAGE_SIZE))
+	with tempfile.TemporaryDirectory() as workdir:
+		flash_file = os.path.join(workdir, 'flash.bin')
+		link = os.path.join(workdir, 'ttySIM')
+		sim_log = open(os.path.join(workdir, 'sim.log'), 'w+')
+		#flash times are kept so the erase is still running when END DATA arrives
+		sim_proc = subprocess.Popen([sys.argv[1], '-f', flash_file, '-l', link, '-n', '2'],
+			stdout=subprocess.DEVNULL, stderr=sim_log)
+		deadline = time.time() + SIM_START_TIMEOUT
+		while not os.path.exists(link) and time.time() < deadline:
+			time.sleep(0.05)
+		ok = True
+		for sessions, (version, extra_args) in enumerate((('1.0.0', []), ('1.0.1', ['-i', '-F'])), 1):
+			packed = pack(image, version)
+			image_file = os.path.join(workdir, f'app_{version}.img')
+			with open(image_file, 'wb') as file:
+				file.write(packed)
+			out = upload(link, image_file, extra_args)
+			wait_session_end(sim_log, sessions)
+			with open(flash_file, 'rb') as file:
+				flash = file.read()
+			sent = 'Sucessfully sent firmware to device' in out
+			in_slot = flash[MAIN_SLOT_OFFSET:MAIN_SLOT_OFFSET + APP_SLOT_SIZE] == slot_of(packed)
+			print(f'v{version} {" ".join(extra_args)}: {"sent" if sent else "FAILED"}, main slot {"ok" if in_slot else "WRONG"}')
+			if not sent or not in_slot:
+				print(out)
+				ok = False
+				break
+		if ok and 'no block differs' not in out:
+			print('the second upload was not an empty sync')
+			ok = False
+		try:
+			sim_proc.wait(timeout=SIM_START_TIMEOUT)
+		except subprocess.TimeoutExpired:
+			sim_proc.kill()
+			sim_proc.wait()
+		if not ok:
+			sim_log.seek(0)
+			print(sim_log.read())
+		sim_log.close()
+	return 0 if ok else 1
+
+
+if __name__ == '__main__':
+	raise SystemExit(main())
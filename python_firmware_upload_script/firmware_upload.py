@@ -1,44 +1,130 @@
 import serial
 import serial.tools.list_ports
 import threading
+import queue
 import time
 import argparse
+import re
+from pack_image import stm32_crc32, split_trailer, parse_trailer, version_str
 
 #TODO: Add stm32 ready for file transmission
 #TODO: Have python code bring either app back to bootloader or just have python code start firmware update mode
 
 ser = None
+#ser_lock is held for writes and port changes, rx_lock for reads and the rx buffers
 ser_lock = threading.Lock()
-#Frame Format: [SOF(0x1A)][Payload Type(start sending data, data, end sending data)][Payload size(2 byte)][Payload][Checksum][EOF(0xA1)]
+rx_lock = threading.Lock()
+#set while the reader thread may use the port
+port_ready_event = threading.Event()
+#a blocking read wakes up on the first byte, the timeout only bounds how long a port change can wait
+READ_TIMEOUT = 0.5
+#Frame Format(v3): [SOF(0x1D)][Payload Type(start sending data, data, end sending data)][Seq(2 byte)][Payload size(2 byte)][Payload][CRC(4 byte)][EOF(0xF3)]
+#CRC is stm32_crc32() of every byte from Payload Type to the end of Payload, padded with zeros to whole words
 CHUNK_SIZE = 2048
+#Payload bytes per data frame, up to CHUNK_SIZE(the bootloader's MAX_DATA_SIZE) in whole words
+chunk_size = CHUNK_SIZE
+#SOF, Payload Type, Seq, Payload size, CRC and EOF
+FRAME_OVERHEAD = 11
 
-OTA_SOF = 0x1A
+OTA_SOF_V3 = 0x1D
 OTA_EOF = 0xF3
 
 OTA_DATA_TYPE_START_DATA = 0x31
 OTA_DATA_TYPE_END_DATA = 0x32
 OTA_DATA_TYPE_DATA = 0x33
+OTA_DATA_TYPE_SET_BAUD = 0x35
+OTA_DATA_TYPE_LINK_PROBE = 0x36
+OTA_DATA_TYPE_SLOT_INFO = 0x37
+#Payload: [Offset in the slot(4 byte)][Data], the bootloader leaves the gaps erased
+OTA_DATA_TYPE_DATA_AT = 0x38
+OTA_DATA_TYPE_IMAGE_INFO = 0x39
+#Payload: [Slot address(4 byte)], ends the session and boots the slot without a download
+OTA_DATA_TYPE_BOOT_SLOT = 0x3A
+OTA_DATA_TYPE_BLOCK_HASHES = 0x3B
 
-OTA_ACK = 0xAA
-OTA_NACK = 0xFF
+#Status Response: [ACK/NACK][Next Seq(2 byte)][SACK bitmap][Window]
+#every frame before Next Seq is in flash, bit n of SACK is frame Next Seq + 1 + n being buffered
+OTA_STATUS_ACK = 0xAB
+OTA_STATUS_NACK = 0xAC
+STATUS_RESPONSE_SIZE = 5
 
 OTA_NEW_FIRMWARE = 0x34
 
 
+#Ready Response: [0xA2][Erase State], older bootloaders only send 0xA2
 OTA_BOOTLOADER_UPLOAD_READY = 0xA2
+OTA_ERASE_STATE_NONE = 0x00
+#the slot is erased from the first frame after IMAGE INFO and BOOT SLOT, START DATA and the first window
+#are taken in during the erase
+OTA_ERASE_STATE_AHEAD = 0x01
+#Slot Info Response: [0xA3][Base slot CRC(4 byte)][Address of the slot being written(4 byte)]
+OTA_SLOT_INFO = 0xA3
+SLOT_INFO_SIZE = 9
+SLOT_INFO_TIMEOUT = 2
+#Image Info Response: [0xA4][Active slot address(4 byte)] then for the main and the backup slot
+#[Image size(4 byte)][Image CRC(4 byte)][Load address(4 byte)][Version(4 byte)], size 0 is a slot
+#without a valid trailer and the CRC is over the whole slot
+OTA_IMAGE_INFO = 0xA4
+IMAGE_INFO_SIZE = 37
+BCKUP_APP_SLOT_ADDR = 0x08040000
+#Block Hashes Response: [0xA5][Block size(2 byte)][Block count(2 byte)][CRC of each block of the base slot(4 byte)]
+OTA_BLOCK_HASHES = 0xA5
+BLOCK_HASHES_HEADER_SIZE = 5
 
 MAX_RETRIES = 3
-version = [0, 3]
+#default number of data frames in flight, capped by the window the bootloader reports
+DEFAULT_WINDOW = 4
+version = [0, 14]
 
 DATA_TIMEOUT = 50
+#time without any status before the oldest unacknowledged frame is resent
+RETRANSMIT_TIMEOUT = 2
 NEW_FIRMWARE_TIMEOUT = 15
+#the bootloader only watches the UART for 20ms on a normal boot, the request is repeated faster than that
+#so resetting the board with the script waiting starts the update
+NEW_FIRMWARE_INTERVAL = 0.01
 START_DATA_FRAME_TIMEOUT = 5
 
+#every session starts at this rate, --baud is negotiated after the bootloader is ready
+DEFAULT_BAUD = 115200
+#link probes sent after a baud rate change, every byte value once per 256 bytes
+LINK_PROBE_COUNT = 4
+LINK_PROBE_DATA = bytes((n * 167 + 13) & 0xFF for n in range(256))
+#the bootloader waits 1s for each probe, the uploader waits longer before it gives up on a rate
+LINK_PROBE_TIMEOUT = 1.5
+#rates to step down through when the link gets worse during a session
+BAUD_LADDER = [3000000, 2000000, 1500000, 1000000, 921600, 460800, 230400, DEFAULT_BAUD]
+#a rate is dropped when more than MAX_RESEND_RATIO of the last LINK_QUALITY_FRAMES frames were resends
+LINK_QUALITY_FRAMES = 16
+MAX_RESEND_RATIO = 0.25
+
+#Image Mode sent in START DATA, LZ sends the image as one compressed stream cut into chunk_size frames
+OTA_IMAGE_MODE_RAW = 0x00
+OTA_IMAGE_MODE_LZ = 0x01
+OTA_IMAGE_MODE_DELTA = 0x02
+#DATA AT frames with only the blocks that differ from the base slot, the bootloader copies the rest
+OTA_IMAGE_MODE_SYNC = 0x03
+#LZ4 block format sequences, the bootloader only keeps the last LZ_WINDOW_SIZE bytes as history
+LZ_WINDOW_SIZE = 4096
+LZ_MIN_MATCH = 4
+#application slot size, CRCs are over the whole slot with the image padded with 0xFF
+APP_SLOT_SIZE = 0x20000
+#images without a trailer are linked to run from the main slot
+MAIN_APP_SLOT_ADDR = 0x08020000
+#shortest run of the base image a patch copies instead of inserting
+PATCH_MIN_MATCH = 8
+#shortest run of 0xFF sparse mode leaves out, shorter ones cost less to send than a new frame
+SPARSE_MIN_GAP = 64
+
 endian_bytes_param = 'little'
 
-ack_event = threading.Event()
-nack_event = threading.Event()
+#status responses are queued since more than one can arrive in one read
+status_queue = queue.Queue()
+slot_info_queue = queue.Queue()
+image_info_queue = queue.Queue()
+block_hashes_queue = queue.Queue()
 upload_ready_event = threading.Event()
+erase_state = OTA_ERASE_STATE_NONE
 #Parse CLI argumenets
 #Requires file path to binary file
 def parse_arg():
@@ -51,14 +137,52 @@ def parse_arg():
 	parser.add_argument(
 		'--file', '-f',
 		type=str,
+		nargs='+',
 		required=True,
-		help='Binary file path to upload to device(e.g., firmware.bin)'
+		help='Binary file path to upload to device(e.g., firmware.bin), with one image packed for each slot the one linked for the slot the bootloader writes is sent'
 	)
 	parser.add_argument(
 		'--baud', '-b',
 		type=int,
-		default=115200,
-		help='Baud rate for serial communication (default: 115200)'
+		default=DEFAULT_BAUD,
+		help=f'Baud rate to negotiate with the bootloader for the upload (default: {DEFAULT_BAUD})'
+	)
+	parser.add_argument(
+		'--window', '-w',
+		type=int,
+		default=DEFAULT_WINDOW,
+		help=f'Max data frames in flight, capped by the bootloader (default: {DEFAULT_WINDOW})'
+	)
+	parser.add_argument(
+		'--delta', '-d',
+		type=str,
+		help='Binary file the device is running(e.g., old_firmware.bin), only a patch against it is sent'
+	)
+	parser.add_argument(
+		'--sparse', '-s',
+		action='store_true',
+		help='Leave out runs of 0xFF, the bootloader skips them since the slot is already erased'
+	)
+	parser.add_argument(
+		'--chunk', '-k',
+		type=int,
+		default=CHUNK_SIZE,
+		help=f'Payload bytes per data frame, a multiple of 4 up to {CHUNK_SIZE} (default: {CHUNK_SIZE})'
+	)
+	parser.add_argument(
+		'--compress', '-c',
+		action='store_true',
+		help='Send the image LZ compressed, the bootloader decompresses it while writing to flash'
+	)
+	parser.add_argument(
+		'--incremental', '-i',
+		action='store_true',
+		help='Only send the blocks that differ from the image the device is running, the bootloader copies the rest'
+	)
+	parser.add_argument(
+		'--force', '-F',
+		action='store_true',
+		help='Send the image even if the device already has it'
 	)
 	return parser.parse_args()
 #detects STM32 UART COM Port
@@ -75,45 +199,452 @@ def list_comports():
 		print(f'{port.device}: {port.description}')
 		available_ports.append(port)
 	return available_ports
-#simple checksum calculation
-def create_checksum(data):
-	if not data:
-		return 0x00
-	if type(data) is int:
-		return data
-	checksum = data[0]
-	for n in data[1:]:
-		checksum= checksum ^ n
-	return checksum
-#thread function to read STM32 printf
-#if no response is recogized then func echos response
+#builds a v3 frame in a single buffer, data is copied once so it can be a memoryview into the image
+def create_frame(data_type, seq, data):
+	size = len(data)
+	frame = bytearray(size + FRAME_OVERHEAD)
+	frame[0] = OTA_SOF_V3
+	frame[1] = data_type
+	frame[2:4] = seq.to_bytes(2, endian_bytes_param)
+	frame[4:6] = size.to_bytes(2, endian_bytes_param)
+	frame[6:6 + size] = data
+	frame[6 + size:10 + size] = stm32_crc32(memoryview(frame)[1:6 + size]).to_bytes(4, endian_bytes_param)
+	frame[-1] = OTA_EOF
+	return frame
+#LZ4 block length encoding, a nibble of 15 is followed by bytes that add up to the rest
+def lz_write_length(out, length):
+	while length >= 255:
+		out.append(255)
+		length = length - 255
+	out.append(length)
+#compresses data into LZ4 block format sequences with no match further back than LZ_WINDOW_SIZE
+#greedy matching with a hash table of the last position of every 4 byte string
+def lz_compress(data):
+	out = bytearray()
+	table = {}
+	def write_sequence(literals, offset, match_len):
+		lit_nibble = min(len(literals), 15)
+		match_nibble = min(match_len - LZ_MIN_MATCH, 15) if match_len else 0
+		out.append((lit_nibble << 4) | match_nibble)
+		if lit_nibble == 15:
+			lz_write_length(out, len(literals) - 15)
+		out.extend(literals)
+		if not match_len:
+			return
+		out.extend(offset.to_bytes(2, endian_bytes_param))
+		if match_nibble == 15:
+			lz_write_length(out, match_len - LZ_MIN_MATCH - 15)
+	i = 0
+	literal_start = 0
+	while i + LZ_MIN_MATCH <= len(data):
+		key = data[i:i + LZ_MIN_MATCH]
+		candidate = table.get(key)
+		table[key] = i
+		if candidate == None or i - candidate > LZ_WINDOW_SIZE:
+			i = i + 1
+			continue
+		match_len = LZ_MIN_MATCH
+		while i + match_len < len(data) and data[candidate + match_len] == data[i + match_len]:
+			match_len = match_len + 1
+		write_sequence(data[literal_start:i], i - candidate, match_len)
+		for n in range(i + 1, min(i + match_len, len(data) - LZ_MIN_MATCH + 1)):
+			table[data[n:n + LZ_MIN_MATCH]] = n
+		i = i + match_len
+		literal_start = i
+	#the stream always ends with a sequence that only has literals
+	write_sequence(data[literal_start:], 0, 0)
+	return bytes(out)
+#CRC of a slot holding image, with the image trailer at the end of the slot if there is one
+def slot_crc32(image, trailer=b''):
+	return stm32_crc32(image + b'\xff' * (APP_SLOT_SIZE - len(image) - len(trailer)) + trailer)
+def write_varint(out, value):
+	while value >= 0x80:
+		out.append((value & 0x7F) | 0x80)
+		value = value >> 7
+	out.append(value)
+#builds a patch that rebuilds new out of base(see delta_patch.h)
+#greedy matching, the run after the previous copy is tried first so moved code keeps one delta
+def make_patch(base, new):
+	out = bytearray()
+	index = {}
+	for n in range(len(base) - PATCH_MIN_MATCH, -1, -1):
+		index[base[n:n + PATCH_MIN_MATCH]] = n
+	copy_pos = 0
+	insert_start = 0
+	shift = 0
+	i = 0
+	def write_insert(end):
+		if end > insert_start:
+			write_varint(out, (end - insert_start) << 1)
+			out.extend(new[insert_start:end])
+	while i + PATCH_MIN_MATCH <= len(new):
+		key = new[i:i + PATCH_MIN_MATCH]
+		src = i + shift
+		if base[src:src + PATCH_MIN_MATCH] != key:
+			src = index.get(key)
+			if src == None:
+				i = i + 1
+				continue
+		length = PATCH_MIN_MATCH
+		while i + length < len(new) and src + length < len(base) and base[src + length] == new[i + length]:
+			length = length + 1
+		write_insert(i)
+		delta = src - copy_pos
+		write_varint(out, (length << 1) | 1)
+		write_varint(out, (delta << 1) if delta >= 0 else ((-delta << 1) - 1))
+		copy_pos = src + length
+		shift = src - i
+		i = i + length
+		insert_start = i
+	write_insert(len(new))
+	return bytes(out)
+#splits what the STM32 sends into status responses and printf lines
+#returns the number of bytes used, an incomplete status response is left in the buffer
+text_line = bytearray()
+rx_buffer = bytearray()
+def handle_rx_bytes(rx_buffer):
+	global erase_state
+	i = 0
+	while i < len(rx_buffer):
+		x = rx_buffer[i]
+		if x == OTA_STATUS_ACK or x == OTA_STATUS_NACK:
+			if len(rx_buffer) - i < STATUS_RESPONSE_SIZE:
+				break
+			next_seq = int.from_bytes(rx_buffer[i + 1: i + 3], endian_bytes_param)
+			status_queue.put((x, next_seq, rx_buffer[i + 3], rx_buffer[i + 4]))
+			i = i + STATUS_RESPONSE_SIZE
+			continue
+		if x == OTA_SLOT_INFO:
+			if len(rx_buffer) - i < SLOT_INFO_SIZE:
+				break
+			slot_info_queue.put((int.from_bytes(rx_buffer[i + 1: i + 5], endian_bytes_param),
+				int.from_bytes(rx_buffer[i + 5: i + 9], endian_bytes_param)))
+			i = i + SLOT_INFO_SIZE
+			continue
+		if x == OTA_IMAGE_INFO:
+			if len(rx_buffer) - i < IMAGE_INFO_SIZE:
+				break
+			fields = [int.from_bytes(rx_buffer[n:n + 4], endian_bytes_param) for n in range(i + 1, i + IMAGE_INFO_SIZE, 4)]
+			image_info_queue.put((fields[0], {MAIN_APP_SLOT_ADDR: tuple(fields[1:5]), BCKUP_APP_SLOT_ADDR: tuple(fields[5:9])}))
+			i = i + IMAGE_INFO_SIZE
+			continue
+		if x == OTA_BLOCK_HASHES:
+			if len(rx_buffer) - i < BLOCK_HASHES_HEADER_SIZE:
+				break
+			block_size = int.from_bytes(rx_buffer[i + 1: i + 3], endian_bytes_param)
+			block_count = int.from_bytes(rx_buffer[i + 3: i + 5], endian_bytes_param)
+			size = BLOCK_HASHES_HEADER_SIZE + 4 * block_count
+			if len(rx_buffer) - i < size:
+				break
+			block_hashes_queue.put((block_size, [int.from_bytes(rx_buffer[n:n + 4], endian_bytes_param)
+				for n in range(i + BLOCK_HASHES_HEADER_SIZE, i + size, 4)]))
+			i = i + size
+			continue
+		if x == OTA_BOOTLOADER_UPLOAD_READY:
+			if len(rx_buffer) - i < 2:
+				break
+			erase_state = OTA_ERASE_STATE_NONE
+			if rx_buffer[i + 1] in (OTA_ERASE_STATE_NONE, OTA_ERASE_STATE_AHEAD):
+				erase_state = rx_buffer[i + 1]
+				i = i + 1
+			upload_ready_event.set()
+		elif x == ord('\n'):
+			line = text_line.strip()
+			if line:
+				print(f"STM32: {line.decode(errors='replace')}")
+			text_line.clear()
+		else:
+			text_line.append(x)
+		i = i + 1
+	return i
+#thread function to read STM32 printf and status responses
+#sleeps in a blocking read until bytes arrive, so a status response is handled as soon as it is in
 def serial_read_thread():
 	while True:
-		with ser_lock:
-			if ser != None and ser.in_waiting:
-				try:
-					x = ser.read_until().strip()
-					if x == bytes([OTA_ACK]):
-						ack_event.set()
-					elif  x == bytes([OTA_NACK]):
-						nack_event.set()
-					elif x == bytes([OTA_BOOTLOADER_UPLOAD_READY]):
-						upload_ready_event.set()
-					else:
-						print(f"STM32: {x.decode()}")
-				except Exception as e:
-					print(e)
-		time.sleep(0.1)
+		port_ready_event.wait()
+		with rx_lock:
+			try:
+				data = ser.read(1)
+				if data and ser.in_waiting:
+					data = data + ser.read(ser.in_waiting)
+			except Exception as e:
+				print(e)
+				time.sleep(READ_TIMEOUT)
+				continue
+			rx_buffer.extend(data)
+			del rx_buffer[:handle_rx_bytes(rx_buffer)]
 
 reader_thread = threading.Thread(target=serial_read_thread, daemon=True)
 reader_thread.start()
 
-START_DATA_FRAME = bytes([OTA_SOF, OTA_DATA_TYPE_START_DATA] + list(0x01.to_bytes(2, endian_bytes_param))+ [OTA_DATA_TYPE_START_DATA] + [create_checksum([OTA_DATA_TYPE_START_DATA]), OTA_EOF])
-END_DATA_FRAME = bytes([OTA_SOF, OTA_DATA_TYPE_END_DATA] + list(0x01.to_bytes(2, endian_bytes_param))+ [OTA_DATA_TYPE_END_DATA] + [create_checksum([OTA_DATA_TYPE_END_DATA]), OTA_EOF])
+#waits for a status response, returns None on timeout
+def wait_status(timeout):
+	try:
+		return status_queue.get(timeout=timeout)
+	except queue.Empty:
+		return None
+#sends a frame until the bootloader ACKs it
+def send_until_ack(frame, timeout):
+	num_of_retries = 0
+	while num_of_retries <= MAX_RETRIES:
+		with ser_lock:
+			ser.write(frame)
+		status = wait_status(timeout)
+		if status != None and status[0] == OTA_STATUS_ACK:
+			return status
+		print('NACK received resending data' if status != None else 'Timeout occured resending data')
+		num_of_retries = num_of_retries + 1
+	return None
+#empties the status queue so old responses are not taken for new ones
+def clear_status_queue():
+	while not status_queue.empty():
+		status_queue.get_nowait()
+#cuts payload into chunk_size data frames, the chunks are views into payload so nothing is copied
+def make_chunks(payload):
+	payload = memoryview(payload)
+	return [(OTA_DATA_TYPE_DATA, payload[n:n + chunk_size]) for n in range(0, len(payload), chunk_size)]
+#cuts the spans(start, end) of image into DATA AT frames, the rest of the image is left out
+def make_span_chunks(image, spans):
+	chunks = []
+	for start, end in spans:
+		for n in range(start, end, chunk_size - 4):
+			chunks.append((OTA_DATA_TYPE_DATA_AT, n.to_bytes(4, endian_bytes_param) + image[n:min(n + chunk_size - 4, end)]))
+	return chunks
+#cuts image into DATA AT frames that leave out every run of SPARSE_MIN_GAP or more 0xFF bytes
+def make_sparse_chunks(image):
+	#spans of data in between the gaps, a trailing run of 0xFF is left out as well
+	spans = []
+	start = 0
+	for gap in re.finditer(b'\xff{%d,}' % SPARSE_MIN_GAP, image):
+		spans.append((start, gap.start()))
+		start = gap.end()
+	spans.append((start, len(image)))
+	return make_span_chunks(image, spans)
+#cuts image into DATA AT frames for only the blocks whose CRC differs from the same block of the base
+#slot, runs of changed blocks are sent as one span
+#the block the image ends in is compared as it will be in the slot, padded with 0xFF
+def make_sync_chunks(image, block_size, block_crcs):
+	padded = image + b'\xff' * (-len(image) % block_size)
+	spans = []
+	for n in range(0, len(image), block_size):
+		if n // block_size < len(block_crcs) and stm32_crc32(padded[n:n + block_size]) == block_crcs[n // block_size]:
+			continue
+		end = min(n + block_size, len(image))
+		if spans and spans[-1][1] == n:
+			spans[-1] = (spans[-1][0], end)
+		else:
+			spans.append((n, end))
+	return make_span_chunks(image, spans)
+#asks the bootloader for the CRC of the slot a patch is based on and the slot it writes to
+#returns None if it does not answer
+def get_slot_info():
+	while not slot_info_queue.empty():
+		slot_info_queue.get_nowait()
+	with ser_lock:
+		ser.write(create_frame(OTA_DATA_TYPE_SLOT_INFO, 0, [OTA_DATA_TYPE_SLOT_INFO]))
+	try:
+		return slot_info_queue.get(timeout=SLOT_INFO_TIMEOUT)
+	except queue.Empty:
+		#older bootloaders ACK the frame instead
+		clear_status_queue()
+		return None
+#sends a query that is answered before the slot erase starts and waits for the answer on response_queue
+#returns None if the bootloader does not answer
+def send_query(data_type, response_queue):
+	while not response_queue.empty():
+		response_queue.get_nowait()
+	clear_status_queue()
+	with ser_lock:
+		ser.write(create_frame(data_type, 0, [data_type]))
+	deadline = time.monotonic() + SLOT_INFO_TIMEOUT
+	while time.monotonic() < deadline:
+		try:
+			return response_queue.get(timeout=0.01)
+		except queue.Empty:
+			pass
+		#older bootloaders ACK the frame instead
+		if not status_queue.empty():
+			break
+	clear_status_queue()
+	return None
+#asks the bootloader for the active slot and the size, CRC, load address and version of the image in
+#each slot, has to come before any frame that starts the slot erase
+def get_image_info():
+	return send_query(OTA_DATA_TYPE_IMAGE_INFO, image_info_queue)
+#asks the bootloader for the block size and the CRC of each block of the slot it is running from,
+#has to come before any frame that starts the slot erase
+def get_block_hashes():
+	return send_query(OTA_DATA_TYPE_BLOCK_HASHES, block_hashes_queue)
+#checks whether a slot of the device holds one of the local images linked to run from that slot
+def slot_holds_image(slot, slot_image, images):
+	size, crc, load_addr, _ = slot_image
+	if load_addr != slot or slot not in images:
+		return False
+	file_content, trailer = images[slot]
+	if trailer:
+		info = parse_trailer(trailer)
+		return size == info['image_size'] and crc == info['image_crc']
+	return size == 0 and crc == slot_crc32(file_content)
+#asks the bootloader to boot slot without a download, returns True if it ACKs
+def boot_slot(slot):
+	clear_status_queue()
+	with ser_lock:
+		ser.write(create_frame(OTA_DATA_TYPE_BOOT_SLOT, 0, bytes([OTA_DATA_TYPE_BOOT_SLOT]) + slot.to_bytes(4, endian_bytes_param)))
+	status = wait_status(START_DATA_FRAME_TIMEOUT)
+	return status != None and status[0] == OTA_STATUS_ACK
+#looks for one of the local images on the device, the active slot first
+#returns True if the device boots it and nothing has to be sent
+def skip_if_on_device(images):
+	image_info = get_image_info()
+	if image_info == None:
+		return False
+	active_slot, slots = image_info
+	other_slot = BCKUP_APP_SLOT_ADDR if active_slot == MAIN_APP_SLOT_ADDR else MAIN_APP_SLOT_ADDR
+	for slot in (active_slot, other_slot):
+		size, crc, _, image_version = slots[slot]
+		state = 'active' if slot == active_slot else 'inactive'
+		if size:
+			print(f'Slot 0x{slot:08X}({state}): v{version_str(image_version)}, {size} bytes, CRC 0x{crc:08X}')
+		else:
+			print(f'Slot 0x{slot:08X}({state}): no image trailer, slot CRC 0x{crc:08X}')
+	for slot in (active_slot, other_slot):
+		if slot_holds_image(slot, slots[slot], images) and boot_slot(slot):
+			if slot == active_slot:
+				print('Device is already running this image, nothing to send')
+			else:
+				print(f'Image is already in slot 0x{slot:08X}, switched to it without sending it')
+			return True
+	return False
+#changes the host side baud rate, whatever was received at the old rate is dropped
+def set_port_baud(baud):
+	#takes the port away from the reader thread, cancel_read() wakes it up if it is waiting for bytes
+	port_ready_event.clear()
+	ser.cancel_read()
+	with rx_lock, ser_lock:
+		ser.flush()
+		ser.baudrate = baud
+		ser.reset_input_buffer()
+		rx_buffer.clear()
+		text_line.clear()
+	port_ready_event.set()
+#asks the bootloader to switch to baud and checks the link with LINK_PROBE_COUNT probes
+#has to be called with no data frames in flight
+#returns the baud rate in use afterwards
+def change_baud(baud):
+	current_baud = ser.baudrate
+	clear_status_queue()
+	with ser_lock:
+		ser.write(create_frame(OTA_DATA_TYPE_SET_BAUD, 0, baud.to_bytes(4, endian_bytes_param)))
+	status = wait_status(START_DATA_FRAME_TIMEOUT)
+	if status == None or status[0] != OTA_STATUS_ACK:
+		print(f'Bootloader does not support {baud} baud')
+		return current_baud
+	set_port_baud(baud)
+	for n in range(LINK_PROBE_COUNT):
+		with ser_lock:
+			ser.write(create_frame(OTA_DATA_TYPE_LINK_PROBE, 0, LINK_PROBE_DATA))
+		status = wait_status(LINK_PROBE_TIMEOUT)
+		if status == None or status[0] != OTA_STATUS_ACK:
+			#the bootloader falls back after a broken or missing probe
+			print(f'Link probe failed at {baud} baud, falling back to {DEFAULT_BAUD}')
+			time.sleep(LINK_PROBE_TIMEOUT)
+			set_port_baud(DEFAULT_BAUD)
+			clear_status_queue()
+			return DEFAULT_BAUD
+	print(f'Baud rate: {baud}')
+	return baud
+#next lower rate to try when the link gets worse
+def lower_baud(baud):
+	for rate in BAUD_LADDER:
+		if rate < baud:
+			return rate
+	return DEFAULT_BAUD
+#sends every chunk with up to window frames in flight
+#only the frames the bootloader reports missing are resent
+#starts at first_chunk, returns the number of chunks written to flash
+def send_chunks(chunks, window, first_chunk=0):
+	num_of_chunk = len(chunks)
+	send_order = [0] * num_of_chunk
+	send_count = 0
+	#frames built ahead of time or kept for a resend, dropped once the bootloader has them in flash
+	frames = {}
+	def get_frame(seq):
+		if seq not in frames:
+			data_type, chunk = chunks[seq]
+			frames[seq] = create_frame(data_type, seq, chunk)
+		return frames[seq]
+	def send_chunk(seq):
+		nonlocal send_count
+		print(f"Sending Chunk: {seq + 1}")
+		frame = get_frame(seq)
+		with ser_lock:
+			ser.write(frame)
+		send_order[seq] = send_count
+		send_count = send_count + 1
+	base = first_chunk
+	next_chunk = first_chunk
+	num_of_retries = 0
+	#True for every resent frame, False for every new one
+	resend_history = []
+	def resend_chunk(seq):
+		resend_history.append(True)
+		send_chunk(seq)
+	while base < num_of_chunk:
+		#link quality check, too many resends means the rate is too high for the link
+		del resend_history[:-LINK_QUALITY_FRAMES]
+		drop_baud = ser.baudrate > DEFAULT_BAUD and len(resend_history) == LINK_QUALITY_FRAMES and \
+			resend_history.count(True) > MAX_RESEND_RATIO * LINK_QUALITY_FRAMES
+		if drop_baud and base == next_chunk:
+			#every frame in flight is ACKed, safe to change the rate
+			print('Too many resends, lowering baud rate')
+			change_baud(lower_baud(ser.baudrate))
+			resend_history.clear()
+			continue
+		while not drop_baud and next_chunk < num_of_chunk and next_chunk < base + window:
+			resend_history.append(False)
+			send_chunk(next_chunk)
+			next_chunk = next_chunk + 1
+		#the next frame is built while the ones in flight are on the link
+		if next_chunk < num_of_chunk:
+			get_frame(next_chunk)
+		status = wait_status(RETRANSMIT_TIMEOUT)
+		if status == None:
+			print('Timeout waiting for status, retransmitting frame')
+			num_of_retries = num_of_retries + 1
+			if num_of_retries > MAX_RETRIES:
+				break
+			resend_chunk(base)
+			continue
+		status_type, next_seq, sack, _ = status
+		if next_seq > base:
+			#cumulative ACK, every frame before next_seq is in flash
+			for seq in range(base, min(next_seq, num_of_chunk)):
+				frames.pop(seq, None)
+			base = min(next_seq, num_of_chunk)
+			num_of_retries = 0
+		elif status_type == OTA_STATUS_NACK:
+			num_of_retries = num_of_retries + 1
+			if num_of_retries > MAX_RETRIES:
+				break
+		sacked = [next_seq + 1 + n for n in range(8) if sack & (1 << n) and next_seq + 1 + n < num_of_chunk]
+		if sacked:
+			#a missing frame that was sent before a frame the bootloader got is lost
+			newest = max(send_order[n] for n in sacked)
+			for seq in range(base, max(sacked)):
+				if seq not in sacked and send_order[seq] < newest:
+					resend_chunk(seq)
+		elif status_type == OTA_STATUS_NACK and base < next_chunk:
+			resend_chunk(base)
+	return base
 
 def main():
-	global ser
+	global ser, chunk_size
 	args = parse_arg()
+	#flash is programmed a word at a time, so every frame has to start on a word
+	if args.chunk % 4 != 0 or not 8 <= args.chunk <= CHUNK_SIZE:
+		print(f'Chunk size has to be a multiple of 4 from 8 to {CHUNK_SIZE}')
+		return
+	chunk_size = args.chunk
 	print(f"Bootloader Firmware Updater v{version[0]}.{version[1]}")
 	port = None
 	if args.port == None:
@@ -128,106 +659,133 @@ def main():
 	else:
 		port = args.port
 	if ser == None:
-		ser = serial.Serial(port=port, baudrate=args.baud)
-	x = args.file
-	file_content = b'0'
-	file_size = 0
-	print(f'Firmware File Location: {x}')
-	#reads in binary file
-	with open(x, "rb") as file:
-		file_content = file.read()
-		file_size = len(file_content)
-	print(f'File Size: {file_size/1000} KB')
-	#calculates number of chunks
-	num_of_chunk = int(file_size / CHUNK_SIZE)
-	if (file_size % CHUNK_SIZE) > 0:
-		num_of_chunk = num_of_chunk + 1
-	print(f'Total Chunks({int(CHUNK_SIZE/1000)}KB each): {num_of_chunk}')
+		ser = serial.Serial(port=port, baudrate=DEFAULT_BAUD, timeout=READ_TIMEOUT)
+		port_ready_event.set()
+	#images by the address they are linked to run from
+	images = {}
+	for x in args.file:
+		print(f'Firmware File Location: {x}')
+		#reads in binary file
+		with open(x, "rb") as file:
+			file_content = file.read()
+		#an image packed by pack_image.py is sent without its trailer, the trailer goes in END DATA
+		file_content, trailer = split_trailer(file_content)
+		print(f'File Size: {len(file_content)/1000} KB')
+		load_addr = MAIN_APP_SLOT_ADDR
+		if trailer:
+			info = parse_trailer(trailer)
+			load_addr = info['load_addr']
+			print(f'Image v{version_str(info["version"])}, load address 0x{load_addr:08X}')
+		images.setdefault(load_addr, (file_content, trailer))
 	print('Waiting for board to accept new firmware')
 	#lets bootloader/application know there is a new firmware
+	deadline = time.monotonic() + NEW_FIRMWARE_TIMEOUT
 	with ser_lock:
 		ser.write(bytes([OTA_NEW_FIRMWARE]))
-	start_time = time.time()
-	while(not upload_ready_event.is_set()):
-		if time.time() - start_time > NEW_FIRMWARE_TIMEOUT:
+	while(not upload_ready_event.wait(NEW_FIRMWARE_INTERVAL)):
+		if time.monotonic() >= deadline:
 			print("Timeout occured resending data")
-			with ser_lock:
-				ser.write(bytes([OTA_NEW_FIRMWARE]))
-			start_time = time.time()
+			deadline = time.monotonic() + NEW_FIRMWARE_TIMEOUT
+		with ser_lock:
+			ser.write(bytes([OTA_NEW_FIRMWARE]))
 	upload_ready_event.clear()
 	print('Device ready sending firmware')
-	time.sleep(0.3)
-	with ser_lock:
-		ser.write(START_DATA_FRAME)
+	#the images on the device are only intact until the first frame that is not a query
+	if not args.force and skip_if_on_device(images):
+		wait_for_restart()
+		return
+	#the base slot is read before the erase starts, it is not used if the image ends up as a patch
+	block_hashes = get_block_hashes() if args.incremental and not args.delta else None
+	if args.incremental and block_hashes == None and not args.delta:
+		print('Bootloader does not send block hashes, sending the whole image')
+	if erase_state == OTA_ERASE_STATE_AHEAD:
+		print('Slot is erased ahead of START DATA, sending during the erase')
+	else:
+		#older bootloaders and one with a download to resume only erase after START DATA
+		time.sleep(0.3)
+	slot_info = None
+	#asked before the baud rate change, a base slot without a trailer is read for it before the erase starts
+	if len(images) > 1 or args.delta or block_hashes != None:
+		slot_info = get_slot_info()
+	if args.baud != DEFAULT_BAUD:
+		change_baud(args.baud)
+	#the bootloader writes the slot it is not running from, an image linked for that slot runs without
+	#being copied, one linked for the main slot is copied there
+	if slot_info != None and slot_info[1] in images:
+		print(f'Bootloader writes slot 0x{slot_info[1]:08X}')
+		file_content, trailer = images[slot_info[1]]
+	else:
+		file_content, trailer = images.get(MAIN_APP_SLOT_ADDR, next(iter(images.values())))
+	file_size = len(file_content)
+	#the image CRC lets the bootloader check a raw image and resume it after a broken session
+	start_data = [OTA_DATA_TYPE_START_DATA, OTA_IMAGE_MODE_RAW] + list(slot_crc32(file_content).to_bytes(4, endian_bytes_param))
+	payload = file_content
+	if args.delta:
+		#a patch only works against the exact image in the backup slot
+		with open(args.delta, "rb") as file:
+			base, base_trailer = split_trailer(file.read())
+		#the bootloader describes a base with a trailer by its image CRC
+		base_crc = parse_trailer(base_trailer)['image_crc'] if base_trailer else slot_crc32(base)
+		if slot_info == None or slot_info[0] != base_crc:
+			print(f'Device is not running {args.delta}, sending the whole image')
+		else:
+			patch = make_patch(base, file_content)
+			print(f'Patch Size: {len(patch)/1000} KB')
+			if len(patch) < file_size:
+				payload = patch
+				start_data = [OTA_DATA_TYPE_START_DATA, OTA_IMAGE_MODE_DELTA] + \
+					list(slot_crc32(file_content).to_bytes(4, endian_bytes_param)) + list(base_crc.to_bytes(4, endian_bytes_param))
+	chunks = None
+	if block_hashes != None and slot_info != None:
+		block_size, block_crcs = block_hashes
+		chunks = make_sync_chunks(file_content, block_size, block_crcs)
+		sent = sum(len(c) - 4 for _, c in chunks)
+		if chunks:
+			print(f'Sync: {sent/1000} KB of {file_size/1000} KB differs from the running image')
+		else:
+			#only START DATA and END DATA are sent, the bootloader copies the whole image and checks it
+			print('Sync: no block differs from the running image, it is copied as it is')
+		start_data = [OTA_DATA_TYPE_START_DATA, OTA_IMAGE_MODE_SYNC] + list(slot_crc32(file_content).to_bytes(4, endian_bytes_param)) + \
+			list(slot_info[0].to_bytes(4, endian_bytes_param)) + list(file_size.to_bytes(4, endian_bytes_param))
+	if args.compress and payload is file_content and chunks == None:
+		#the frames carry the compressed stream, the bootloader writes file_size bytes
+		start_data = [OTA_DATA_TYPE_START_DATA, OTA_IMAGE_MODE_LZ]
+		payload = lz_compress(file_content)
+		print(f'Compressed Size: {len(payload)/1000} KB (ratio {file_size/max(len(payload), 1):.2f})')
+	if chunks == None and args.sparse and start_data[1] == OTA_IMAGE_MODE_RAW:
+		chunks = make_sparse_chunks(file_content)
+		print(f'Sparse Size: {sum(len(c) - 4 for _, c in chunks)/1000} KB')
+	elif chunks == None:
+		chunks = make_chunks(payload)
+	num_of_chunk = len(chunks)
+	print(f'Total Chunks({chunk_size/1000}KB each): {num_of_chunk}')
+	status = send_until_ack(create_frame(OTA_DATA_TYPE_START_DATA, 0, start_data), START_DATA_FRAME_TIMEOUT)
+	if status == None:
+		print("Bootloader did not accept START DATA")
+		return
+	window = max(1, min(args.window, status[3]))
+	print(f'Window: {window} frames')
+	#every chunk before Next Seq is already in flash from an earlier session
+	first_chunk = min(status[1], num_of_chunk)
+	if first_chunk > 0:
+		print(f'Resuming at chunk {first_chunk + 1}')
 	start_time = time.time()
-	while( not ack_event.is_set()):
-		if nack_event.is_set():
-			print('Nack received resending data')
-			with ser_lock:
-				ser.write(START_DATA_FRAME)
-			nack_event.clear()
-		elif time.time() - start_time > START_DATA_FRAME_TIMEOUT:
-			print("Timeout occured resending data")
-			with ser_lock:
-				ser.write(START_DATA_FRAME)
-			start_time = time.time()
-	ack_event.clear()
-	num_of_retries = 0
-	failed_transmission = 0
-	n = 0
-	while(len(file_content) > 0):
-		chunked_data = list(file_content[0: CHUNK_SIZE])
-		data_frame = bytes([OTA_SOF, OTA_DATA_TYPE_DATA] + list(len(chunked_data).to_bytes(2, endian_bytes_param))+ chunked_data + [create_checksum(chunked_data), OTA_EOF])
-		print(f"Sending Chunk: {n + 1}")
-		with ser_lock:
-			ser.write(data_frame)
-		start_time = time.time()
-		while True:
-			if ack_event.is_set():
-				n = n + 1
-				file_content = file_content[CHUNK_SIZE: ]
-				ack_event.clear()
-				num_of_retries = 0
-				break
-			elif nack_event.is_set():
-				print('NACK received retransmitting frame')
-				num_of_retries = num_of_retries + 1
-				nack_event.clear()
-				break
-			elif time.time() - start_time > DATA_TIMEOUT:
-				print('Timeout waiting for ACK/NACK')
-				print('Retransmitting frame')
-				start_time = time.time()
-				num_of_retries = num_of_retries + 1
-				break
-		if num_of_retries > MAX_RETRIES:
-			failed_transmission = 1
-			break
-			
-				
-	if failed_transmission:
+	n = send_chunks(chunks, window, first_chunk)
+	if n != num_of_chunk:
 		print("Max Retransmission Reached.")
 		print("Failed to transmit whole file")
-	elif num_of_chunk != n:
-		print('Sent Chunks does not equal calculated chunks')
+	elif send_until_ack(create_frame(OTA_DATA_TYPE_END_DATA, num_of_chunk, bytes([OTA_DATA_TYPE_END_DATA]) + trailer), 5) == None:
+		print('Bootloader did not accept END DATA')
 		print('Transmission corrupted')
 	else:
-		with ser_lock:
-			ser.write(END_DATA_FRAME)
-		start_time = time.time()
-		while( not ack_event.is_set()):
-			if nack_event.is_set():
-				print('Nack received resending end data frame')
-				with ser_lock:
-					ser.write(END_DATA_FRAME)
-				nack_event.clear()
-			elif time.time() - start_time > 5:
-				#send_data_frame(OTA_DATA_TYPE_END_DATA, 1, OTA_DATA_TYPE_END_DATA)
-				with ser_lock:
-					ser.write(END_DATA_FRAME)
-				start_time = time.time()
-		ack_event.clear()
+		elapsed = max(time.time() - start_time, 0.001)
 		print('Sucessfully sent firmware to device')
+		print(f'{elapsed:.2f} s, {file_size/elapsed/1000:.1f} KB/s of firmware, {sum(len(c) for _, c in chunks[first_chunk:])/elapsed/1000:.1f} KB/s on the link')
+	#the bootloader goes back to the default rate at the end of the session
+	set_port_baud(DEFAULT_BAUD)
+	wait_for_restart()
+#lets the user quit or start over with the next board
+def wait_for_restart():
 	user_input = ''
 	while(user_input != 'q'):
 		user_input = input("Type q to quit or r to restart \n\n")
@@ -0,0 +1,206 @@
+import argparse
+import itertools
+import json
+import os
+import platform
+import random
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+#Runs full update sessions of firmware_upload.py against the host simulator(bootloader/sim) over
+#a matrix of image sizes, chunk sizes, baud rates and injected line error rates
+#every run gets a new erased flash file and a new simulator, results are written as JSON
+
+UPLOADER = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'firmware_upload.py')
+MAIN_SLOT_OFFSET = 0x20000
+BCKUP_SLOT_OFFSET = 0x40000
+#time for the simulator to create its serial port
+SIM_START_TIMEOUT = 5
+#a session that takes longer than this is counted as failed
+RUN_TIMEOUT = 600
+
+DEFAULT_SIZES = [16384, 65536]
+DEFAULT_CHUNKS = [512, 2048]
+DEFAULT_BAUDS = [115200, 921600]
+DEFAULT_ERRORS = [0, 0.0001]
+
+#Parse CLI argumenets
+def parse_arg():
+	parser = argparse.ArgumentParser(description="OTA Throughput Benchmark")
+	parser.add_argument(
+		'--sim',
+		type=str,
+		required=True,
+		help='Path to the bootloader_sim executable'
+	)
+	parser.add_argument(
+		'--sizes',
+		type=int,
+		nargs='+',
+		default=DEFAULT_SIZES,
+		help=f'Image sizes in bytes, at most 128K (default: {DEFAULT_SIZES})'
+	)
+	parser.add_argument(
+		'--chunks',
+		type=int,
+		nargs='+',
+		default=DEFAULT_CHUNKS,
+		help=f'Payload bytes per data frame (default: {DEFAULT_CHUNKS})'
+	)
+	parser.add_argument(
+		'--bauds',
+		type=int,
+		nargs='+',
+		default=DEFAULT_BAUDS,
+		help=f'Baud rates to negotiate (default: {DEFAULT_BAUDS})'
+	)
+	parser.add_argument(
+		'--errors',
+		type=float,
+		nargs='+',
+		default=DEFAULT_ERRORS,
+		help=f'Share of bytes received by the bootloader that get a bit flipped (default: {DEFAULT_ERRORS})'
+	)
+	parser.add_argument(
+		'--time-scale', '-t',
+		type=float,
+		default=1.0,
+		help='Scale of the simulated flash programming and erase times (default: 1)'
+	)
+	parser.add_argument(
+		'--output', '-o',
+		type=str,
+		help='JSON file to write the results to (default: stdout)'
+	)
+	return parser.parse_args()
+#image that looks like firmware: code that repeats in places and an erased tail
+def make_image(size):
+	rng = random.Random(size)
+	image = bytearray()
+	while len(image) < size * 7 // 8:
+		block = bytes(rng.getrandbits(8) for _ in range(rng.randint(16, 256)))
+		image += block * rng.randint(1, 3)
+	del image[size * 7 // 8:]
+	image += b'\xff' * (size - len(image))
+	return bytes(image)
+#first int a pattern finds in text, None if it is not there
+def find_int(pattern, text):
+	match = re.search(pattern, text, re.M)
+	return int(match.group(1)) if match else None
+#turns what the uploader and the simulator printed into the numbers of one run
+def parse_run(size, upload_out, sim_out, elapsed):
+	sent_chunks = re.findall(r'^Sending Chunk: (\d+)', upload_out, re.M)
+	sent = len(sent_chunks)
+	frames = find_int(r'^Total Chunks\([^)]*\): (\d+)', upload_out) or 0
+	host_time = re.search(r'^([\d.]+) s, ', upload_out, re.M)
+	host_time = float(host_time.group(1)) if host_time else elapsed
+	device_ms = find_int(r'STM32: (\d+) ms, ', upload_out)
+	program_us = find_int(r'STM32: Programming: (\d+) us total', upload_out)
+	checksum_us = find_int(r'STM32: Checksum: (\d+) us total', upload_out)
+	#every rate the uploader ended up at, in order
+	rates = re.findall(r'^(?:Baud rate: |Link probe failed at \d+ baud, falling back to )(\d+)', upload_out, re.M)
+	#the simulated clock leaves out the time the simulator spends trapping flash and CRC accesses,
+	#the host clock has it in and only stands in when the bootloader did not report its time
+	seconds = device_ms / 1000 if device_ms else host_time
+	result = {
+		'success': 'Sucessfully sent firmware to device' in upload_out,
+		'seconds': round(seconds, 3),
+		'host_seconds': round(host_time, 3),
+		'bytes_per_s': round(size / seconds) if seconds > 0 else None,
+		'frames': frames,
+		'frames_sent': sent,
+		'frames_per_s': round(sent / seconds, 1) if seconds > 0 else None,
+		'retries': sent - len(set(sent_chunks)),
+		'timeouts': len(re.findall(r'^Timeout', upload_out, re.M)),
+		'crc_errors': len(re.findall(r'^CRC error', sim_out, re.M)),
+		'framing_errors': len(re.findall(r'^(?:Transimission|EOF) error', sim_out, re.M)),
+		#overruns, framing and noise errors the UART flagged and ring overflows, counted by the bootloader
+		'uart_errors': find_int(r'STM32: UART errors: (\d+)', upload_out),
+		'baud_drops': len(re.findall(r'^(?:Too many resends|Link probe failed)', upload_out, re.M)),
+		'final_baud': int(rates[-1]) if rates else None,
+	}
+	#the bootloader's side of the session, link is whatever was not spent programming or checking
+	if device_ms is not None and program_us is not None and checksum_us is not None:
+		result['time_us'] = {
+			'link': max(device_ms * 1000 - program_us - checksum_us, 0),
+			'checksum': checksum_us,
+			'flash': program_us,
+		}
+	return result
+#runs one update session against a new simulator
+def run_one(sim, workdir, image, chunk, baud, error_rate, time_scale):
+	flash_file = os.path.join(workdir, 'flash.bin')
+	image_file = os.path.join(workdir, 'image.bin')
+	link = os.path.join(workdir, 'ttySIM')
+	for path in (flash_file, link):
+		if os.path.lexists(path):
+			os.remove(path)
+	with open(image_file, 'wb') as file:
+		file.write(image)
+	sim_log = open(os.path.join(workdir, 'sim.log'), 'w+')
+	sim_proc = subprocess.Popen([sim, '-f', flash_file, '-l', link, '-t', str(time_scale), '-e', str(error_rate), '-n', '1'],
+		stdout=subprocess.DEVNULL, stderr=sim_log)
+	deadline = time.time() + SIM_START_TIMEOUT
+	while not os.path.exists(link) and time.time() < deadline:
+		time.sleep(0.05)
+	start_time = time.time()
+	try:
+		upload = subprocess.run([sys.executable, UPLOADER, '-p', link, '-f', image_file, '-b', str(baud), '-k', str(chunk)],
+			input='q\n', capture_output=True, text=True, timeout=RUN_TIMEOUT)
+		upload_out = upload.stdout
+	except subprocess.TimeoutExpired as e:
+		upload_out = e.stdout.decode(errors='replace') if e.stdout else ''
+	elapsed = time.time() - start_time
+	try:
+		sim_proc.wait(timeout=SIM_START_TIMEOUT)
+	except subprocess.TimeoutExpired:
+		sim_proc.kill()
+		sim_proc.wait()
+	sim_log.seek(0)
+	sim_out = sim_log.read().replace('\r', '')
+	sim_log.close()
+	result = parse_run(len(image), upload_out.replace('\r', ''), sim_out, elapsed)
+	if result['final_baud'] == None:
+		result['final_baud'] = baud
+	#both slots have to hold the image for the run to count
+	with open(flash_file, 'rb') as file:
+		flash = file.read()
+	result['verified'] = flash[MAIN_SLOT_OFFSET:MAIN_SLOT_OFFSET + len(image)] == image and \
+		flash[BCKUP_SLOT_OFFSET:BCKUP_SLOT_OFFSET + len(image)] == image
+	result['bl_version'] = re.search(r'Starting Bootloader v(\d+\.\d+)', sim_out).group(1) \
+		if 'Starting Bootloader v' in sim_out else None
+	return result
+
+def main():
+	args = parse_arg()
+	results = []
+	bl_version = None
+	with tempfile.TemporaryDirectory() as workdir:
+		for size, chunk, baud, error_rate in itertools.product(args.sizes, args.chunks, args.bauds, args.errors):
+			print(f'size {size} chunk {chunk} baud {baud} error rate {error_rate}', file=sys.stderr)
+			result = run_one(args.sim, workdir, make_image(size), chunk, baud, error_rate, args.time_scale)
+			bl_version = result.pop('bl_version') or bl_version
+			print(f'  {"ok" if result["success"] and result["verified"] else "FAILED"}, {result["bytes_per_s"]} bytes/s, '
+				f'{result["retries"]} retries', file=sys.stderr)
+			results.append({'size': size, 'chunk': chunk, 'baud': baud, 'error_rate': error_rate, **result})
+	report = {
+		'bl_version': bl_version,
+		'host': platform.platform(),
+		'time_scale': args.time_scale,
+		'runs': results,
+	}
+	if args.output:
+		with open(args.output, 'w') as file:
+			json.dump(report, file, indent=2)
+	else:
+		json.dump(report, sys.stdout, indent=2)
+		print()
+	#failed runs make the exit code non zero so CI notices
+	sys.exit(0 if all(r['success'] and r['verified'] for r in results) else 1)
+
+
+if __name__ == '__main__':
+	main()
@@ -0,0 +1,119 @@
+import argparse
+import array
+import struct
+import zlib
+
+#Packs a firmware binary for the bootloader: the image padded with 0xFF to a whole word, then an image
+#trailer(see image_trailer.h) with its size, version, load address and CRC-32. firmware_upload.py sends
+#the image and hands the trailer over in END DATA, the bootloader keeps it in the last 32 bytes of the slot
+
+TRAILER_MAGIC = 0x494D4754
+TRAILER_VERSION = 1
+TRAILER_SIZE = 32
+#magic, format, size, image size, load address, version, image CRC, reserved, trailer CRC
+TRAILER_FORMAT = '<IHHIIIIII'
+APP_SLOT_SIZE = 0x20000
+#the trailer takes the end of the slot
+MAX_IMAGE_SIZE = APP_SLOT_SIZE - TRAILER_SIZE
+#main application slot, where every image runs from
+DEFAULT_LOAD_ADDR = 0x08020000
+
+#every byte with its bits in reverse order
+BIT_REVERSE = bytes(int(f'{n:08b}'[::-1], 2) for n in range(256))
+#CRC-32/MPEG-2 over little endian words(last one padded with zeros), what the STM32 CRC peripheral calculates
+#it is the bit reversed form of zlib's CRC-32, so the work is done by zlib instead of a python loop:
+#words are fed MSB first so the bytes of every word are swapped, then every bit is reversed
+def stm32_crc32(data):
+	data = memoryview(data)
+	whole = len(data) - len(data) % 4
+	words = array.array('I')
+	words.frombytes(data[:whole])
+	if whole < len(data):
+		words.frombytes(bytes(data[whole:]) + bytes(4 - len(data) + whole))
+	words.byteswap()
+	crc = zlib.crc32(words.tobytes().translate(BIT_REVERSE)) ^ 0xFFFFFFFF
+	return int(f'{crc:032b}'[::-1], 2)
+#image padded with 0xFF to a whole word, the way it sits in flash
+def pad_to_word(image):
+	return bytes(image) + b'\xff' * (-len(image) % 4)
+#packs major.minor.patch like IMAGE_VERSION()
+def parse_version(text):
+	parts = [int(n) for n in text.split('.')]
+	if len(parts) != 3 or not (0 <= parts[0] <= 0xFF and 0 <= parts[1] <= 0xFF and 0 <= parts[2] <= 0xFFFF):
+		raise ValueError(f'{text} is not major.minor.patch(0-255.0-255.0-65535)')
+	return (parts[0] << 24) | (parts[1] << 16) | parts[2]
+def version_str(version):
+	return f'{version >> 24}.{(version >> 16) & 0xFF}.{version & 0xFFFF}'
+#trailer describing image
+def make_trailer(image, version, load_addr=DEFAULT_LOAD_ADDR):
+	fields = struct.pack(TRAILER_FORMAT[:-1], TRAILER_MAGIC, TRAILER_VERSION, TRAILER_SIZE, len(image), load_addr, version,
+		stm32_crc32(pad_to_word(image)), 0xFFFFFFFF)
+	return fields + stm32_crc32(fields).to_bytes(4, 'little')
+#fields of a trailer as a dict, None if it is not a valid trailer
+def parse_trailer(trailer):
+	if len(trailer) != TRAILER_SIZE:
+		return None
+	magic, fmt, size, image_size, load_addr, version, image_crc, _, trailer_crc = struct.unpack(TRAILER_FORMAT, trailer)
+	if magic != TRAILER_MAGIC or fmt != TRAILER_VERSION or size != TRAILER_SIZE or \
+		trailer_crc != stm32_crc32(trailer[:-4]):
+		return None
+	return {'image_size': image_size, 'load_addr': load_addr, 'version': version, 'image_crc': image_crc}
+#splits a packed file into the image and its trailer, a file without one comes back as it is with an empty trailer
+def split_trailer(data):
+	info = parse_trailer(data[-TRAILER_SIZE:])
+	if info == None or info['image_size'] > len(data) - TRAILER_SIZE:
+		return data, b''
+	return data[:info['image_size']], bytes(data[-TRAILER_SIZE:])
+
+#Parse CLI argumenets
+def parse_arg():
+	parser = argparse.ArgumentParser(description="Bootloader Image Packer")
+	parser.add_argument(
+		'--file', '-f',
+		type=str,
+		required=True,
+		help='Path to the firmware binary file'
+	)
+	parser.add_argument(
+		'--output', '-o',
+		type=str,
+		required=True,
+		help='Path to write the packed image to'
+	)
+	parser.add_argument(
+		'--version', '-v',
+		type=str,
+		default='0.0.0',
+		help='Image version as major.minor.patch (default: 0.0.0)'
+	)
+	parser.add_argument(
+		'--address', '-a',
+		type=lambda x: int(x, 0),
+		default=DEFAULT_LOAD_ADDR,
+		help=f'Address the image is linked to run from (default: 0x{DEFAULT_LOAD_ADDR:08X})'
+	)
+	return parser.parse_args()
+
+def main():
+	args = parse_arg()
+	with open(args.file, 'rb') as file:
+		image = file.read()
+	#a file that was already packed is packed again from its image
+	image, _ = split_trailer(image)
+	if not 0 < len(image) <= MAX_IMAGE_SIZE:
+		print(f'Image has to be 1 to {MAX_IMAGE_SIZE} bytes, the end of the slot holds the trailer')
+		return 1
+	try:
+		version = parse_version(args.version)
+	except ValueError as e:
+		print(e)
+		return 1
+	trailer = make_trailer(image, version, args.address)
+	with open(args.output, 'wb') as file:
+		file.write(pad_to_word(image) + trailer)
+	print(f'Image v{version_str(version)}, {len(image)} bytes, load address 0x{args.address:08X}, CRC 0x{parse_trailer(trailer)["image_crc"]:08X}')
+	return 0
+
+
+if __name__ == '__main__':
+	raise SystemExit(main())